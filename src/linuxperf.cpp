@@ -2,18 +2,34 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #include "linuxperf_profiling.hpp"
+#include "linuxperf_protocol.hpp"
+#include "linuxperf_tree.hpp"
+#include "linuxperf_symbols.hpp"
+#include "linuxperf_output.hpp"
+#include "linuxperf_sources.hpp"
 #include <adaptyst/output.hpp>
 #include <string>
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <boost/algorithm/string.hpp>
 #include <boost/program_options/parsers.hpp>
 #include <boost/predef.h>
 #include <unordered_set>
 #include <nlohmann/json.hpp>
-#include <boost/asio.hpp>
 #include <regex>
 #include <variant>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
 
 #define ADAPTYST_MODULE_ENTRYPOINT
 #include <adaptyst/hw.h>
@@ -37,6 +53,21 @@ volatile const char *options[] = {
   "capture_mode",
   "perf_path",
   "perf_script_path",
+  "wire_format",
+  "native_decoder",
+  "merge_events",
+  "group_read",
+  "start_paused",
+  "control_fifo",
+  "checkpoint_interval",
+  "timed_memory_limit",
+  "attach_pids",
+  "attach_cgroup",
+  "attach_duration",
+  "loss_warning_threshold",
+#ifdef LIBZSTD_AVAILABLE
+  "compression_level",
+#endif
 #if defined(ADAPTYST_ROOFLINE) && defined(BOOST_ARCH_X86) && defined(BOOST_COMP_GNUC)
   "roofline",
   "roofline_benchmark_path",
@@ -117,7 +148,9 @@ volatile const char *filter_help =
   "only stack elements matching a set of conditions "
   "specified in a given text file. "
   "python:<FILE> sends all stack trace elements to "
-  "a given Python script for filtering. Unless filter_mark is "
+  "a given Python script for filtering (in batches of "
+  "distinct callchains if the script defines process_batch() "
+  "in addition to setup()). Unless filter_mark is "
   "used, all filtered out elements are deleted "
   "completely. See the Adaptyst documentation to check "
   "in detail how to use filtering.";
@@ -153,6 +186,127 @@ volatile const char *perf_script_path_help =
 volatile const option_type perf_script_path_type = STRING;
 volatile const char *perf_script_path_default = "";
 
+volatile const char *wire_format_help =
+  "Format of samples sent internally from the linuxperf scripts "
+  "to the module: \"binary\" (compact length-prefixed frames) or "
+  "\"json\" (slower, kept as a fallback) (default: \"binary\")";
+volatile const option_type wire_format_type = STRING;
+volatile const char *wire_format_default = "binary";
+
+volatile const char *native_decoder_help =
+  "Decode samples of on-CPU/off-CPU and extra event profiling "
+  "directly in the module instead of running perf-script. This "
+  "is faster, but it is not compatible with \"filter\" (perf-script "
+  "is still used in this case) (default: false)";
+volatile const option_type native_decoder_type = BOOL;
+volatile const bool native_decoder_default = false;
+
+volatile const char *merge_events_help =
+  "Sample all extra events (including the roofline ones) with "
+  "a single profiler instead of running a separate profiler for "
+  "each of them. Samples are then split by event type, so events "
+  "with the same type (i.e. the same name before the first \"/\") "
+  "still get separate profilers (default: false)";
+volatile const option_type merge_events_type = BOOL;
+volatile const bool merge_events_default = false;
+
+volatile const char *group_read_help =
+  "Read all extra events (including the roofline ones) in a group "
+  "together with every on-CPU sample instead of sampling them "
+  "separately. The increase of each event since the previous sample "
+  "is then attributed to the same stack as the sample, so the results "
+  "of different events can be compared function by function. PERIOD "
+  "of extra events is ignored in this case. Hardware events must fit "
+  "in the available hardware counters at the same time, otherwise "
+  "they are not counted at all (default: false)";
+volatile const option_type group_read_type = BOOL;
+volatile const bool group_read_default = false;
+
+volatile const char *start_paused_help =
+  "Start all profilers with event capturing paused. Capturing "
+  "must then be resumed through \"control_fifo\" (default: false)";
+volatile const option_type start_paused_type = BOOL;
+volatile const bool start_paused_default = false;
+
+volatile const char *control_fifo_help =
+  "Path to a named pipe (created if it doesn't exist) through which "
+  "event capturing of all profilers can be paused and resumed, e.g. by "
+  "the profiled program, by writing \"pause\" or \"resume\" lines "
+  "to it. This allows profiling only a region of interest of "
+  "a program. When attaching to running processes, writing \"stop\" "
+  "ends profiling (default: \"\", i.e. disabled)";
+volatile const option_type control_fifo_type = STRING;
+volatile const char *control_fifo_default = "";
+
+volatile const char *checkpoint_interval_help =
+  "Interval in seconds at which the untimed results of all threads "
+  "profiled so far are saved while profiling is still running, so "
+  "that they survive a crash and can be inspected before a long "
+  "run finishes. Every checkpoint replaces the previous one "
+  "atomically. 0 disables checkpoints (default: 0)";
+volatile const option_type checkpoint_interval_type = UNSIGNED_INT;
+volatile const unsigned int checkpoint_interval_default = 0;
+
+volatile const char *timed_memory_limit_help =
+  "Memory limit in MiB for the timed (time-ordered) results of all "
+  "threads, including the stacks they refer to. When it is exceeded, "
+  "older parts of the timeline of every thread are merged into "
+  "progressively coarser time buckets, while recent samples keep "
+  "their full resolution. Totals of functions and offsets are not "
+  "affected. Distinct stacks are always kept, so a run with more of "
+  "them than fit in the limit may still exceed it. 0 means no limit "
+  "(default: 0)";
+volatile const option_type timed_memory_limit_type = UNSIGNED_INT;
+volatile const unsigned int timed_memory_limit_default = 0;
+
+volatile const char *attach_pids_help =
+  "PIDs of already running processes to attach to instead of "
+  "profiling the command run by Adaptyst, e.g. services which can't "
+  "be restarted. Threads existing at the start are put in the thread "
+  "tree from /proc. Profiling ends when attach_duration elapses, "
+  "when \"stop\" is written to \"control_fifo\", when all the "
+  "processes exit (or the cgroup becomes empty, see \"attach_cgroup\") "
+  "or when the command run by Adaptyst (e.g. "
+  "\"sleep infinity\") finishes, whichever comes first. The command "
+  "is terminated if it is still running then (default: none)";
+volatile const option_type attach_pids_array_type = STRING;
+volatile const char *attach_pids_array_default[] = {};
+volatile const unsigned int attach_pids_array_default_size = 0;
+
+volatile const char *attach_cgroup_help =
+  "Name of a cgroup (relative to the root of the cgroup hierarchy, "
+  "e.g. \"system.slice/nginx.service\") whose processes should be "
+  "attached to, see \"attach_pids\". This profiles all CPUs in the "
+  "CPU mask. Cannot be used together with \"attach_pids\" "
+  "(default: \"\", i.e. disabled)";
+volatile const option_type attach_cgroup_type = STRING;
+volatile const char *attach_cgroup_default = "";
+
+volatile const char *attach_duration_help =
+  "Number of seconds after which profiling of processes attached to "
+  "(see \"attach_pids\" and \"attach_cgroup\") ends. 0 means "
+  "no limit (default: 0)";
+volatile const option_type attach_duration_type = UNSIGNED_INT;
+volatile const unsigned int attach_duration_default = 0;
+
+volatile const char *loss_warning_threshold_help =
+  "Percentage of samples of a profiler which may be lost (e.g. because "
+  "of full buffers) before a warning is printed. The numbers of lost "
+  "samples and of times the kernel has throttled sampling are saved "
+  "for every profiler and thread regardless. Lost samples can be "
+  "counted only with \"native_decoder\" (default: 1)";
+volatile const option_type loss_warning_threshold_type = UNSIGNED_INT;
+volatile const unsigned int loss_warning_threshold_default = 1;
+
+#ifdef LIBZSTD_AVAILABLE
+volatile const char *compression_level_help =
+  "zstd compression level (1-22) of all result files of the module. "
+  "Compressed files have the \".zst\" suffix appended to their names. "
+  "0 disables compression (default: 0)";
+volatile const option_type compression_level_type = UNSIGNED_INT;
+volatile const unsigned int compression_level_default = 0;
+#endif
+
 #if defined(ADAPTYST_ROOFLINE) && defined(BOOST_ARCH_X86) && defined(BOOST_COMP_GNUC)
 volatile const char *roofline_help =
   "Run also "
@@ -179,15 +333,170 @@ using namespace adaptyst;
 using namespace std::chrono_literals;
 namespace ch = std::chrono;
 
+/**
+   A structure describing the overhead of processing a connection,
+   saved in telemetry.json.
+
+   Times are in nanoseconds and end is when the last message has
+   been processed. read_time is the time spent waiting for
+   and reading messages (and decoding them with the native decoder),
+   so the rest of the lifetime of a connection
+   is spent processing them. latency_sum and latency_max are computed
+   from the differences between the times samples have been taken
+   and ingested. script_data is what perf-script has reported about
+   itself, if anything (see write_telemetry() in event-handler.py).
+*/
+typedef struct {
+  ch::steady_clock::time_point start = ch::steady_clock::now();
+  ch::steady_clock::time_point end;
+  unsigned long long messages = 0;
+  unsigned long long samples = 0;
+  unsigned long long read_time = 0;
+  unsigned long long latency_sum = 0;
+  unsigned long long latency_max = 0;
+  unsigned long long tree_nodes = 0;
+  nlohmann::json script_data = nullptr;
+} Telemetry;
+
 typedef struct {
-  std::unordered_map<std::string, std::unordered_set<std::string> > dso_offsets;
   bool perf_maps_expected;
   bool error;
   ConnectionException exception;
+  Telemetry telemetry;
+  std::vector<PerfLoss> losses;
 } ConnectionResult;
 
+typedef struct {
+  std::string pid;
+  std::string tid;
+  CallTree untimed;
+  TimedSequence timed;
+
+  // The sampled period and off-CPU intervals not yet saved in
+  // the thread directory (see flush_thread_accounting())
+  Path dir;
+  unsigned long long pending_period;
+  std::vector<std::pair<unsigned long long, unsigned long long> > pending_offcpu;
+
+  // Whether the thread has received samples since the last
+  // checkpoint (see checkpoint())
+  bool changed_since_checkpoint;
+} ThreadData;
+
+typedef struct {
+  std::string extra_event_name = "";
+  bool first_event_received = false;
+  StackTable stack_table;
+  std::unordered_map<std::string, ThreadData> thread_data_map;
+} SampleState;
+
+typedef struct {
+  std::string pid;
+  std::string tid;
+  std::string parent;
+  std::string comm;
+} AttachedThread;
+
+typedef struct {
+  std::string dir;
+  std::string extra_event_name;
+  std::unique_ptr<StackTable> stack_table;
+  ThreadData data;
+} HandedOverThread;
+
+/**
+   A structure describing threads of a profiler being moved between
+   its connections, so that a few busy threads don't end up being
+   processed by the same worker.
+
+   A profiler moves a thread by sending a "release" message through
+   the old connection and a "takeover" message through the new one
+   before any sample of the thread. Both messages carry the sequence
+   number of the move, as a thread may be moved again before its
+   previous move has completed. The thread state released by the
+   old connection is put in threads under the thread and the move
+   number and the new connection waits for it there.
+*/
+typedef struct {
+  std::mutex mutex;
+  std::condition_variable released;
+  unsigned int active_connections = 0;
+  std::unordered_map<std::string, std::vector<HandedOverThread> > threads;
+} ThreadHandover;
+
+/**
+   A class running a function in a thread of its own every given
+   number of seconds until it is stopped or destroyed. If the number
+   of seconds is 0, the function is never run.
+*/
+class PeriodicTask {
+private:
+  std::mutex mutex;
+  std::condition_variable stop_requested;
+  bool stopped;
+  std::thread thread;
+
+public:
+  PeriodicTask(unsigned int interval, std::function<void()> func) : stopped(false) {
+    if (interval == 0) {
+      return;
+    }
+
+    this->thread = std::thread([this, interval, func]() {
+      std::unique_lock<std::mutex> lock(this->mutex);
+
+      while (!this->stop_requested.wait_for(lock, ch::seconds(interval),
+                                            [this]() { return this->stopped; })) {
+        lock.unlock();
+        func();
+        lock.lock();
+      }
+    });
+  }
+
+  ~PeriodicTask() {
+    this->stop();
+  }
+
+  /**
+     Stops running the function, waiting for its current run
+     to finish.
+  */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopped = true;
+    }
+
+    this->stop_requested.notify_all();
+
+    if (this->thread.joinable()) {
+      this->thread.join();
+    }
+  }
+};
+
 class CPULinuxModule {
 private:
+  // The number of off-CPU intervals of a thread after which they
+  // are saved in the thread directory along with the sampled period
+  static constexpr std::size_t ACCOUNTING_FLUSH_SIZE = 4096;
+
+  // The number of new offsets in executables/libraries after which
+  // they are passed to the source resolver (the same number is
+  // used by event-handler.py)
+  static constexpr std::size_t SOURCE_BATCH_SIZE = 4096;
+
+  // The number of messages/samples of a connection after which
+  // the memory used by its timed results is checked against
+  // timed_memory_limit
+  static constexpr std::size_t TIMED_MEMORY_CHECK_INTERVAL = 16384;
+
+  // The number of untimed tree nodes copied for a checkpoint at
+  // once, i.e. without letting the connection worker process
+  // any message in the meantime
+  static constexpr std::size_t CHECKPOINT_COPY_SIZE = 16384;
+
   unsigned int buf_size;
   unsigned int warmup;
   unsigned int freq;
@@ -197,128 +506,717 @@ private:
   std::vector<PerfEvent> events;
   Perf::Filter filter;
   Perf::CaptureMode capture_mode;
+  Profiler::WireFormat wire_format;
+  bool native_decoder;
+  bool merge_events;
+  bool group_read;
+  bool start_paused;
+  fs::path control_fifo_path;
+  unsigned int checkpoint_interval;
+  std::mutex checkpoint_mutex;
+  std::atomic<std::uint64_t> result_file_version = 0;
+  std::mutex result_file_mutex;
+  std::unordered_map<std::string, std::uint64_t> result_file_versions;
+  std::size_t timed_memory_limit;
+  std::atomic<std::size_t> timed_memory_usage = 0;
+  std::atomic<bool> timed_memory_limit_reached = false;
+  Perf::Target attach_target;
+  fs::path attach_cgroup_path;
+  unsigned int attach_duration;
+  std::atomic<bool> attach_stop_requested = false;
+  std::vector<AttachedThread> attached_threads;
+  unsigned int loss_warning_threshold;
+  unsigned int compression_level = 0;
   CPUConfig cpu_config;
   fs::path perf_bin_path;
   fs::path perf_python_path;
   fs::path perf_script_path;
   unsigned long long profile_start;
   bool profile_start_set = false;
+  SymbolTable symbol_table;
+  std::unique_ptr<SourceResolver> source_resolver;
   amod_t module_id;
 #if defined(ADAPTYST_ROOFLINE) && defined(BOOST_ARCH_X86) && defined(BOOST_COMP_GNUC)
   unsigned int roofline_freq;
   fs::path roofline_benchmark_path;
 #endif
 
-  void save_sample(nlohmann::json *data,
-                   std::vector<std::pair<std::string, std::string> > &callchain_parts,
-                   unsigned long long period,
-                   bool time_ordered, bool offcpu) {
-    bool last_block;
+  void ingest_sample(SampleState &state, Path &dir,
+                     std::string &event_type,
+                     std::string &pid, std::string &tid,
+                     unsigned long long timestamp,
+                     unsigned long long period,
+                     std::vector<CallchainElem> &callchain) {
+    if (!state.first_event_received) {
+      state.first_event_received = true;
 
-    if (time_ordered) {
-      nlohmann::json *cur_elem = data;
+      if (event_type == "offcpu-time" || event_type == "task-clock") {
+        state.extra_event_name = "";
 
-      const std::string key = offcpu ? "cold_value" : "hot_value";
-      (*cur_elem)[key] = (unsigned long long)(*cur_elem)[key] + period;
-      (*cur_elem)["value"] = (unsigned long long)(*cur_elem)["value"] + period;
+        if (timestamp - period < this->profile_start) {
+          period = timestamp - this->profile_start;
+        }
+      } else {
+        state.extra_event_name = event_type;
+      }
+    } else if ((state.extra_event_name != "" && event_type != state.extra_event_name) ||
+               (state.extra_event_name == "" && event_type != "offcpu-time" && event_type != "task-clock")) {
+      adaptyst_print(this->module_id, ("The recently received sample is of different event type than expected "
+                                       "(received: " + event_type + ", expected: " +
+                                       (state.extra_event_name == "" ? "task-clock or offcpu-time" : state.extra_event_name) +
+                                       "), ignoring.").c_str(), true, false, "General");
+      return;
+    }
 
-      int index = 0;
+    std::string pid_tid = pid + "_" + tid;
 
-      if (!callchain_parts.empty()) {
-        do {
-          last_block = index == callchain_parts.size() - 1;
-          bool elem_assigned = false;
+    auto thread_data = state.thread_data_map.find(pid_tid);
 
-          if ((*cur_elem)["children"].size() > 0) {
-            nlohmann::json *child = &(*cur_elem)["children"][(*cur_elem)["children"].size() - 1];
-            std::string candidate_name = (*child)["name"];
+    if (thread_data == state.thread_data_map.end()) {
+      thread_data = state.thread_data_map.emplace(pid_tid, ThreadData{
+          pid, tid, CallTree(), TimedSequence(state.stack_table),
+          dir / pid / tid, 0, {}, true}).first;
+    }
 
-            if (candidate_name == callchain_parts[index].first) {
-              if ((last_block && (*child)["children"].size() == 0) ||
-                  (!last_block && (*child)["children"].size() > 0)) {
-                cur_elem = child;
-                elem_assigned = true;
-              }
-            }
+    if (event_type == "offcpu-time") {
+      if (timestamp - this->profile_start < period) {
+        thread_data->second.pending_offcpu.push_back({0, timestamp - this->profile_start});
+      } else {
+        thread_data->second.pending_offcpu.push_back(
+          {timestamp - this->profile_start - period, period});
+      }
+    }
+
+    thread_data->second.untimed.add_sample(callchain, period,
+                                           event_type == "offcpu-time");
+    thread_data->second.timed.add_sample(callchain, period,
+                                         event_type == "offcpu-time");
+
+    thread_data->second.pending_period += period;
+    thread_data->second.changed_since_checkpoint = true;
+
+    if (thread_data->second.pending_offcpu.size() >= ACCOUNTING_FLUSH_SIZE) {
+      this->flush_thread_accounting(thread_data->second);
+    }
+  }
+
+  /**
+     Saves the sampled period and off-CPU intervals accumulated
+     in memory for a thread in its directory. This is done in bulk
+     rather than per sample to keep metadata and file-system
+     operations out of sample processing.
+  */
+  void flush_thread_accounting(ThreadData &thread_data) {
+    if (!thread_data.pending_offcpu.empty()) {
+      Array<std::pair<
+        unsigned long long, unsigned long long> > offcpu(thread_data.dir, "offcpu");
+
+      for (auto &interval : thread_data.pending_offcpu) {
+        offcpu.push_back(interval);
+      }
+
+      thread_data.pending_offcpu.clear();
+    }
+
+    if (thread_data.pending_period > 0) {
+      thread_data.dir.set_metadata<
+        unsigned long long>("sampled_period",
+                            thread_data.dir.get_metadata<
+                            unsigned long long>("sampled_period", 0) +
+                            thread_data.pending_period);
+      thread_data.pending_period = 0;
+    }
+  }
+
+  /**
+     Gets the extension of a result file, taking compression
+     into account.
+  */
+  std::string get_extension(std::string extension) {
+    return this->compression_level > 0 ? extension + ".zst" : extension;
+  }
+
+  /**
+     Writes a result file with a given function, compressing it
+     if requested. Returns whether the file has been written
+     successfully.
+  */
+  bool write_result(std::ostream &stream,
+                    std::function<bool(std::ostream &)> write_func) {
+#ifdef LIBZSTD_AVAILABLE
+    if (this->compression_level > 0) {
+      ZstdOstream compressed(stream, this->compression_level);
+      bool result = write_func(compressed);
+      return compressed.finish() && result;
+    }
+#endif
+
+    return write_func(stream) && stream.flush();
+  }
+
+  /**
+     Gets a new version of result files (see write_result_file()).
+     Versions increase with every call.
+  */
+  std::uint64_t get_result_version() {
+    return ++this->result_file_version;
+  }
+
+  /**
+     Writes a result file with a given function (see write_result())
+     atomically, i.e. to a temporary file which is renamed to the
+     final path only once it is complete. This way, an existing
+     result file (e.g. from a checkpoint) is never replaced by
+     a partially written one.
+
+     version is the version of the data being written (see
+     get_result_version()), obtained when the data was taken (e.g.
+     when a tree was copied for a checkpoint), or 0 for a new one.
+     Files written concurrently have temporary files of their own
+     and a file is never replaced by one of an older version, e.g.
+     a late checkpoint of a thread which has since been moved to
+     another connection.
+  */
+  void write_result_file(fs::path path,
+                         std::function<bool(std::ostream &)> write_func,
+                         std::uint64_t version = 0) {
+    if (version == 0) {
+      version = this->get_result_version();
+    }
+
+    fs::path tmp_path = path;
+    tmp_path += "." + std::to_string(getpid()) + "." + std::to_string(version) + ".tmp";
+
+    {
+      std::ofstream stream(tmp_path);
+
+      if (!stream) {
+        throw std::runtime_error(("Could not open " + tmp_path.string() + " for writing").c_str());
+      }
+
+      if (!this->write_result(stream, write_func)) {
+        throw std::runtime_error(("Could not write to " + tmp_path.string() + ". Do you have "
+                                  "enough disk space?").c_str());
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(this->result_file_mutex);
+    std::uint64_t &latest_version = this->result_file_versions[path.string()];
+
+    if (latest_version > version) {
+      fs::remove(tmp_path);
+      return;
+    }
+
+    fs::rename(tmp_path, path);
+    latest_version = version;
+  }
+
+  template<class T>
+  void write_sample_tree(fs::path dir_path, ThreadData &thread_data,
+                         std::string name, T &tree) {
+    this->write_result_file(dir_path / thread_data.pid /
+                            thread_data.tid / this->get_extension(name),
+                            [&tree](std::ostream &output) {
+                              JsonWriter writer(output);
+                              tree.write(writer);
+                              return writer.finish();
+                            });
+  }
+
+  /**
+     Ingests a sample received from a profiler into the state and
+     directory corresponding to its event type.
+
+     If event_dirs is empty, the profiler samples a single event
+     and all its samples go to dir. Otherwise, the profiler samples
+     all events in event_dirs at once and its samples are split
+     between their directories by event type.
+
+     states is keyed by directory paths, as more than one event
+     type can go to the same directory (e.g. task-clock and
+     offcpu-time).
+  */
+  void demux_sample(std::unordered_map<std::string, SampleState> &states,
+                    Path &dir,
+                    std::unordered_map<std::string, Path> &event_dirs,
+                    std::unique_ptr<Profiler> &profiler,
+                    std::string &event_type,
+                    std::string &pid, std::string &tid,
+                    unsigned long long timestamp,
+                    unsigned long long period,
+                    std::vector<CallchainElem> &callchain) {
+    if (event_dirs.empty()) {
+      this->ingest_sample(states[dir.get_path_name()], dir, event_type,
+                          pid, tid, timestamp, period, callchain);
+      return;
+    }
+
+    auto event_dir = event_dirs.find(event_type);
+
+    if (event_dir == event_dirs.end()) {
+      adaptyst_print(this->module_id, ("The recently received sample from profiler \"" +
+                                       profiler->get_name() + "\" is of unexpected event type " +
+                                       event_type + ", ignoring.").c_str(), true, false, "General");
+      return;
+    }
+
+    this->ingest_sample(states[event_dir->second.get_path_name()],
+                        event_dir->second, event_type, pid, tid,
+                        timestamp, period, callchain);
+  }
+
+  /**
+     Moves the state of a thread out of a connection, so that another
+     connection of the same profiler can take it over (see
+     ThreadHandover).
+  */
+  void release_thread(std::unordered_map<std::string, SampleState> &states,
+                      ThreadHandover &handover,
+                      std::string &pid, std::string &tid,
+                      std::string &move) {
+    std::string pid_tid = pid + "_" + tid;
+    std::vector<HandedOverThread> released;
+
+    for (auto &state : states) {
+      auto thread_data = state.second.thread_data_map.find(pid_tid);
+
+      if (thread_data == state.second.thread_data_map.end()) {
+        continue;
+      }
+
+      // The stack table of the connection may be gone by the time
+      // the thread is taken over, so the timed sequence is copied
+      // to a stack table of its own.
+      ThreadData &data = thread_data->second;
+      std::unique_ptr<StackTable> stack_table = std::make_unique<StackTable>();
+      StackTable &stack_table_ref = *stack_table;
+
+      released.push_back(HandedOverThread{
+          state.first, state.second.extra_event_name, std::move(stack_table),
+          ThreadData{data.pid, data.tid, std::move(data.untimed),
+            TimedSequence(stack_table_ref), data.dir, data.pending_period,
+            std::move(data.pending_offcpu), true}});
+      released.back().data.timed.append(data.timed);
+
+      state.second.thread_data_map.erase(thread_data);
+    }
+
+    std::lock_guard<std::mutex> lock(handover.mutex);
+    std::vector<HandedOverThread> &threads = handover.threads[pid_tid + "_" + move];
+
+    for (auto &thread : released) {
+      threads.push_back(std::move(thread));
+    }
+
+    handover.released.notify_all();
+  }
+
+  /**
+     Waits for the state of a thread to be released by another
+     connection of the same profiler and moves it to this connection
+     (see ThreadHandover).
+  */
+  void take_over_thread(std::unordered_map<std::string, SampleState> &states,
+                        ThreadHandover &handover,
+                        std::unique_ptr<Profiler> &profiler,
+                        std::string &pid, std::string &tid,
+                        std::string &move) {
+    std::string pid_tid = pid + "_" + tid;
+    std::string key = pid_tid + "_" + move;
+    std::vector<HandedOverThread> released;
+
+    {
+      std::unique_lock<std::mutex> lock(handover.mutex);
+
+      // If this is the only connection still running, the thread
+      // will never be released.
+      handover.released.wait(lock, [&handover, &key]() {
+        return handover.threads.find(key) != handover.threads.end() ||
+          handover.active_connections <= 1;
+      });
+
+      auto entry = handover.threads.find(key);
+
+      if (entry == handover.threads.end()) {
+        adaptyst_print(this->module_id, ("Profiler \"" + profiler->get_name() + "\" has moved "
+                                         "thread " + pid + "/" + tid + " between connections, "
+                                         "but its state has never been released. Samples of "
+                                         "the thread received so far may be missing.").c_str(),
+                       true, false, "General");
+        return;
+      }
+
+      released = std::move(entry->second);
+      handover.threads.erase(entry);
+    }
+
+    for (auto &thread : released) {
+      SampleState &state = states[thread.dir];
+
+      if (!state.first_event_received) {
+        state.first_event_received = true;
+        state.extra_event_name = thread.extra_event_name;
+      }
+
+      ThreadData &data = thread.data;
+      auto result = state.thread_data_map.emplace(pid_tid, ThreadData{
+          data.pid, data.tid, std::move(data.untimed),
+          TimedSequence(state.stack_table), data.dir, data.pending_period,
+          std::move(data.pending_offcpu), true});
+
+      if (!result.second) {
+        adaptyst_print(this->module_id, ("Profiler \"" + profiler->get_name() + "\" has moved "
+                                         "thread " + pid + "/" + tid + " to a connection "
+                                         "already processing it, ignoring the moved "
+                                         "state.").c_str(), true, false, "General");
+        continue;
+      }
+
+      result.first->second.timed.append(data.timed);
+    }
+  }
+
+  /**
+     Saves a checkpoint of the untimed trees of all threads of
+     a connection which have received samples since the previous
+     checkpoint, along with their sampled period and off-CPU intervals
+     and the symbols referenced by the trees.
+
+     This is run every checkpoint_interval seconds by a PeriodicTask
+     of the connection, so that connections which have gone quiet
+     are saved as well. states_mutex is held by the connection worker
+     while it processes a message. The trees are copied with it held,
+     but only CHECKPOINT_COPY_SIZE nodes at a time (see
+     CallTree::copy_nodes()), so the worker is never stalled for
+     longer than that by a checkpoint, and are written once it is
+     released.
+  */
+  void checkpoint(std::unordered_map<std::string, SampleState> &states,
+                  std::mutex &states_mutex) {
+    std::vector<std::pair<std::string, std::string> > threads;
+
+    {
+      std::lock_guard<std::mutex> lock(states_mutex);
+
+      for (auto &state : states) {
+        for (auto &entry : state.second.thread_data_map) {
+          ThreadData &data = entry.second;
+
+          if (!data.changed_since_checkpoint) {
+            continue;
           }
 
-          if (!elem_assigned) {
-            (*cur_elem)["children"].push_back(nlohmann::json::object());
-            nlohmann::json &obj = (*cur_elem)["children"][(*cur_elem)["children"].size() - 1];
-            obj["name"] = callchain_parts[index].first;
-            obj["value"] = 0;
-            obj["hot_value"] = 0;
-            obj["cold_value"] = 0;
-            obj["offsets"] = nlohmann::json::object();
-            obj["children"] = nlohmann::json::array();
-            cur_elem = &obj;
+          this->flush_thread_accounting(data);
+          threads.push_back(std::make_pair(state.first, entry.first));
+          data.changed_since_checkpoint = false;
+        }
+      }
+    }
+
+    if (threads.empty()) {
+      return;
+    }
+
+    try {
+      // Only one tree is copied at a time, so a checkpoint needs
+      // at most as much memory as the largest tree.
+      for (auto &[dir, pid_tid] : threads) {
+        CallTree tree;
+        std::size_t copied = 0;
+        fs::path path;
+        std::uint64_t version = 0;
+
+        // The thread may be moved to another connection in the
+        // meantime (see ThreadHandover), in which case it is left
+        // to the checkpoints of that connection.
+        while (version == 0) {
+          std::lock_guard<std::mutex> lock(states_mutex);
+          auto state = states.find(dir);
+
+          if (state == states.end()) {
+            break;
           }
 
-          (*cur_elem)[key] = (unsigned long long)(*cur_elem)[key] + period;
-          (*cur_elem)["value"] = (unsigned long long)(*cur_elem)["value"] + period;
+          auto thread_data = state->second.thread_data_map.find(pid_tid);
+
+          if (thread_data == state->second.thread_data_map.end()) {
+            break;
+          }
 
-          std::string &offset = callchain_parts[index].second;
-          std::string offset_key = offcpu ? "cold_value" : "hot_value";
+          ThreadData &data = thread_data->second;
+          copied = data.untimed.copy_nodes(tree, copied, CHECKPOINT_COPY_SIZE);
 
-          if (!(*cur_elem)["offsets"].contains(offset)) {
-            (*cur_elem)["offsets"][offset] = nlohmann::json::object();
-            (*cur_elem)["offsets"][offset]["cold_value"] = 0;
-            (*cur_elem)["offsets"][offset]["hot_value"] = 0;
+          if (copied == data.untimed.get_node_count()) {
+            path = fs::path(dir) / data.pid / data.tid / this->get_extension("untimed.json");
+            version = this->get_result_version();
           }
+        }
 
-          (*cur_elem)["offsets"][offset][offset_key] =
-            (unsigned long long)(*cur_elem)["offsets"][offset][offset_key] + period;
+        if (version > 0) {
+          this->write_result_file(path, [&tree](std::ostream &output) {
+            JsonWriter writer(output);
+            tree.write(writer);
+            return writer.finish();
+          }, version);
+        }
+      }
 
-          index++;
-        } while (!last_block);
+      // All symbols referenced by the trees have been interned
+      // before they were copied, so they are all in the table now.
+      std::lock_guard<std::mutex> lock(this->checkpoint_mutex);
+      this->write_result_file(fs::path(adaptyst_get_module_dir(this->module_id)) /
+                              this->get_extension("callchains.json"),
+                              [this](std::ostream &output) {
+                                return (bool)(output << this->symbol_table.to_json().dump()
+                                              << std::endl);
+                              });
+    } catch (std::exception &e) {
+      adaptyst_print(this->module_id, ("Could not save a checkpoint: " +
+                                       std::string(e.what())).c_str(),
+                     true, false, "General");
+    }
+  }
+
+  /**
+     Keeps the memory used by the timed results of all connections,
+     including their stack tables, within timed_memory_limit by
+     compacting the timed sequences of a connection when the limit
+     is exceeded (see TimedSequence::compact()).
+
+     This is checked only every TIMED_MEMORY_CHECK_INTERVAL calls
+     counted by message_count. reported_usage is the memory usage
+     of the connection most recently added to timed_memory_usage.
+
+     Stack tables can't be compacted, so the limit may be out of
+     reach. If compacting doesn't get the usage under the limit,
+     the connection compacts again only once its usage has grown
+     by a quarter, as stored in next_compaction, so that sequences
+     aren't rescanned in vain after every check.
+  */
+  void limit_timed_memory(std::unordered_map<std::string, SampleState> &states,
+                          std::size_t &message_count,
+                          std::size_t &reported_usage,
+                          std::size_t &next_compaction) {
+    if (this->timed_memory_limit == 0 ||
+        ++message_count < TIMED_MEMORY_CHECK_INTERVAL) {
+      return;
+    }
+
+    message_count = 0;
+
+    auto get_usage = [&states]() {
+      std::size_t usage = 0;
+
+      for (auto &state : states) {
+        usage += state.second.stack_table.get_memory_usage();
+
+        for (auto &entry : state.second.thread_data_map) {
+          usage += entry.second.timed.get_memory_usage();
+        }
       }
-    } else {
-      nlohmann::json *cur_elem = data;
 
-      std::string key = offcpu ? "cold_value" : "hot_value";
-      (*cur_elem)[key] = (unsigned long long)(*cur_elem)[key] + period;
-      (*cur_elem)["value"] = (unsigned long long)(*cur_elem)["value"] + period;
+      return usage;
+    };
 
-      int index = 0;
+    std::size_t usage = get_usage();
+    std::size_t total_usage = (this->timed_memory_usage += usage - reported_usage);
+    reported_usage = usage;
 
-      if (!callchain_parts.empty()) {
-        do {
-          last_block = index == callchain_parts.size() - 1;
-
-          if (!(*cur_elem)["children"].contains(callchain_parts[index].first)) {
-            nlohmann::json &obj = (*cur_elem)["children"][callchain_parts[index].first] = nlohmann::json::object();
-            obj["name"] = callchain_parts[index].first;
-            obj["value"] = 0;
-            obj["hot_value"] = 0;
-            obj["cold_value"] = 0;
-            obj["offsets"] = nlohmann::json::object();
-            obj["children"] = nlohmann::json::object();
-          }
+    if (total_usage <= this->timed_memory_limit || usage < next_compaction) {
+      return;
+    }
 
-          cur_elem = &(*cur_elem)["children"][callchain_parts[index].first];
-          (*cur_elem)[key] = (unsigned long long)(*cur_elem)[key] + period;
-          (*cur_elem)["value"] = (unsigned long long)(*cur_elem)["value"] + period;
+    if (!this->timed_memory_limit_reached.exchange(true)) {
+      adaptyst_print(this->module_id, "Timed results have exceeded \"timed_memory_limit\", "
+                     "older samples will be shown with reduced time resolution.",
+                     true, false, "General");
+    }
 
-          std::string &offset = callchain_parts[index].second;
-          std::string offset_key = offcpu ? "cold_value" : "hot_value";
+    for (auto &state : states) {
+      for (auto &entry : state.second.thread_data_map) {
+        entry.second.timed.compact();
+      }
+    }
 
-          if (!(*cur_elem)["offsets"].contains(offset)) {
-            (*cur_elem)["offsets"][offset] = nlohmann::json::object();
-            (*cur_elem)["offsets"][offset]["cold_value"] = 0;
-            (*cur_elem)["offsets"][offset]["hot_value"] = 0;
-          }
+    usage = get_usage();
+    total_usage = (this->timed_memory_usage += usage - reported_usage);
+    reported_usage = usage;
+    next_compaction = total_usage > this->timed_memory_limit ? usage + usage / 4 : 0;
+  }
 
-          (*cur_elem)["offsets"][offset][offset_key] =
-            (unsigned long long)(*cur_elem)["offsets"][offset][offset_key] + period;
-          index++;
-        } while (!last_block);
+  void write_sample_trees(std::unordered_map<std::string, SampleState> &states) {
+    for (auto &state : states) {
+      for (auto &entry : state.second.thread_data_map) {
+        this->flush_thread_accounting(entry.second);
+        this->write_sample_tree(state.first, entry.second, "untimed.json",
+                                entry.second.untimed);
+        this->write_sample_tree(state.first, entry.second, "timed.json",
+                                entry.second.timed);
+      }
+    }
+  }
+
+  /**
+     Records in telemetry that a message has been read, with reading
+     having started at read_start.
+  */
+  void record_read(Telemetry &telemetry, ch::steady_clock::time_point read_start) {
+    telemetry.messages++;
+    telemetry.read_time += ch::duration_cast<ch::nanoseconds>(
+      ch::steady_clock::now() - read_start).count();
+  }
+
+  /**
+     Records in telemetry that a sample taken at timestamp
+     (CLOCK_MONOTONIC, in nanoseconds, like all perf timestamps here)
+     has been ingested.
+  */
+  void record_sample(Telemetry &telemetry, unsigned long long timestamp) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    unsigned long long latency = now_ns > timestamp ? now_ns - timestamp : 0;
+
+    telemetry.samples++;
+    telemetry.latency_sum += latency;
+    telemetry.latency_max = std::max(telemetry.latency_max, latency);
+  }
+
+  /**
+     Records in telemetry the sizes of the results of a connection.
+  */
+  void record_result_sizes(Telemetry &telemetry,
+                           std::unordered_map<std::string, SampleState> &states) {
+    for (auto &state : states) {
+      for (auto &entry : state.second.thread_data_map) {
+        telemetry.tree_nodes += entry.second.untimed.get_node_count();
+      }
+    }
+  }
+
+  /**
+     Converts the telemetry of a connection to its telemetry.json
+     form, with per-sample and per-second values derived from
+     the totals.
+  */
+  nlohmann::json telemetry_to_json(Telemetry &telemetry) {
+    unsigned long long duration = ch::duration_cast<ch::nanoseconds>(
+      telemetry.end - telemetry.start).count();
+    unsigned long long processing_time =
+      duration > telemetry.read_time ? duration - telemetry.read_time : 0;
+
+    nlohmann::json result = nlohmann::json::object();
+    result["duration"] = duration;
+    result["messages"] = telemetry.messages;
+    result["messages_per_second"] = duration > 0 ?
+      telemetry.messages * 1e9 / duration : 0.0;
+    result["samples"] = telemetry.samples;
+    result["processing_time"] = processing_time;
+    result["processing_time_per_sample"] = telemetry.samples > 0 ?
+      processing_time / telemetry.samples : 0;
+    result["latency_avg"] = telemetry.samples > 0 ?
+      telemetry.latency_sum / telemetry.samples : 0;
+    result["latency_max"] = telemetry.latency_max;
+    result["tree_nodes"] = telemetry.tree_nodes;
+
+    if (!telemetry.script_data.is_null()) {
+      result["perf_script"] = telemetry.script_data;
+    }
+
+    return result;
+  }
+
+  /**
+     Adds a value to a numeric metadata entry of a directory.
+  */
+  void add_metadata(Path &dir, std::string key, unsigned long long value) {
+    dir.set_metadata<unsigned long long>(key, dir.get_metadata<unsigned long long>(key, 0) + value);
+  }
+
+  /**
+     Saves the numbers of lost samples and throttling events of
+     a profiler in the metadata of its directory and, where they can
+     be attributed to a thread, of the thread directory (see
+     demux_sample() for how event_dirs is used). A warning is printed
+     if more than loss_warning_threshold percent of samples have been
+     lost or if sampling has been throttled at all.
+  */
+  void record_losses(std::unique_ptr<Profiler> &profiler, Path &dir,
+                     std::unordered_map<std::string, Path> &event_dirs,
+                     unsigned long long samples, std::vector<PerfLoss> &losses) {
+    unsigned long long lost = 0;
+    unsigned long long throttles = 0;
+
+    for (auto &loss : losses) {
+      lost += loss.lost;
+      throttles += loss.throttles;
+
+      if (loss.pid < 0 || loss.tid < 0) {
+        continue;
       }
+
+      Path *thread_parent_dir = &dir;
+
+      if (!event_dirs.empty()) {
+        auto event_dir = event_dirs.find(loss.event_type);
+
+        if (event_dir == event_dirs.end()) {
+          continue;
+        }
+
+        thread_parent_dir = &event_dir->second;
+      }
+
+      Path thread_dir = *thread_parent_dir / std::to_string(loss.pid) / std::to_string(loss.tid);
+      this->add_metadata(thread_dir, "lost_samples", loss.lost);
+      this->add_metadata(thread_dir, "throttles", loss.throttles);
     }
+
+    this->add_metadata(dir, "lost_samples", lost);
+    this->add_metadata(dir, "throttles", throttles);
+
+    if (lost > 0 && lost * 100 > (samples + lost) * this->loss_warning_threshold) {
+      adaptyst_print(this->module_id, ("Profiler \"" + profiler->get_name() + "\" has lost " +
+                                       std::to_string(lost) + " out of " +
+                                       std::to_string(samples + lost) + " samples. Consider "
+                                       "increasing buffer sizes or decreasing the sampling "
+                                       "frequency.").c_str(), true, false, "General");
+    }
+
+    if (throttles > 0) {
+      adaptyst_print(this->module_id, ("Sampling of profiler \"" + profiler->get_name() + "\" "
+                                       "has been throttled by the kernel " +
+                                       std::to_string(throttles) + " time(s), so some samples "
+                                       "are missing. Consider decreasing the sampling frequency "
+                                       "or increasing the period.").c_str(), true, false, "General");
+    }
+  }
+
+  bool map_symbol_codes(std::vector<std::uint32_t> &symbol_ids,
+                        std::vector<CallchainElem> &callchain,
+                        std::unique_ptr<Profiler> &profiler) {
+    for (auto &elem : callchain) {
+      if (elem.first >= symbol_ids.size() || symbol_ids[elem.first] == UINT32_MAX) {
+        adaptyst_print(this->module_id, ("Symbol code " + std::to_string(elem.first) +
+                                         " received from profiler \"" + profiler->get_name() +
+                                         "\" has not been defined, ignoring the message.").c_str(),
+                       true, false, "General");
+        return false;
+      }
+
+      elem.first = symbol_ids[elem.first];
+    }
+
+    return true;
   }
 
   ConnectionResult process_connection(Path &dir,
+                                      std::unordered_map<std::string, Path> &event_dirs,
+                                      ThreadHandover &handover,
                                       std::unique_ptr<Profiler> &profiler,
-                                      std::unique_ptr<Connection> &connection) {
+                                      std::unique_ptr<Connection> &connection,
+                                      bool generic, bool thread_tree) {
     ConnectionResult result;
     result.perf_maps_expected = false;
     result.error = false;
@@ -329,17 +1227,134 @@ private:
     std::unordered_map<std::string, std::vector<std::pair<std::string, unsigned long long> > > name_time_dict;
     std::unordered_map<std::string, std::string> tree;
     std::vector<std::pair<unsigned long long, std::string> > added_list;
-    std::string extra_event_name = "";
-    bool first_event_received = false;
+    std::unordered_map<std::string, SampleState> sample_states;
+
+    // Symbol codes sent by a profiler are local to it, so they
+    // are mapped here to the IDs in this->symbol_table.
+    std::vector<std::uint32_t> symbol_ids;
 
     std::string line;
     bool thread_tree_connection = false;
 
-    std::unordered_map<std::string, nlohmann::json> timed_data_map;
-    std::unordered_map<std::string, nlohmann::json> untimed_data_map;
+    // Threads of processes being attached to have been created before
+    // profiling, so they are put in the tree from /proc rather than
+    // from fork events. thread_tree is set only for the connection
+    // receiving the fork/exit events of the thread tree profiler (the
+    // first one after the generic one), so that a single connection
+    // writes threads.json.
+    if (thread_tree && !this->attached_threads.empty()) {
+      thread_tree_connection = true;
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      unsigned long long time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+      for (auto &thread : this->attached_threads) {
+        tree[thread.tid] = thread.parent;
+        added_list.push_back(std::make_pair(time, thread.tid));
+        combo_dict[thread.tid] = thread.pid + "/" + thread.tid;
+        name_time_dict[thread.tid].push_back(std::make_pair(thread.comm, time));
+      }
+    }
+
+    std::unique_ptr<FrameReader> frame_reader;
+
+    if (!generic && profiler->get_wire_format() == Profiler::BINARY) {
+      frame_reader = std::make_unique<FrameReader>(*connection, this->buf_size);
+    }
+
+    // sample_states is guarded by states_mutex from the checkpoints
+    // of the connection, except while waiting for a message.
+    std::mutex states_mutex;
+    PeriodicTask checkpointer(this->checkpoint_interval,
+                              [this, &sample_states, &states_mutex]() {
+                                this->checkpoint(sample_states, states_mutex);
+                              });
+    std::unique_lock<std::mutex> states_lock(states_mutex);
+
+    std::size_t message_count = 0;
+    std::size_t timed_memory_usage = 0;
+    std::size_t next_compaction = 0;
 
     try {
-      while ((line = connection->read()) != "<STOP>") {
+      while (true) {
+        this->limit_timed_memory(sample_states, message_count, timed_memory_usage,
+                                 next_compaction);
+
+        ch::steady_clock::time_point read_start = ch::steady_clock::now();
+
+        if (frame_reader) {
+          states_lock.unlock();
+          std::string_view frame = frame_reader->read();
+          states_lock.lock();
+
+          FrameParser parser(frame);
+          this->record_read(result.telemetry, read_start);
+          std::string event_type, pid, tid;
+          unsigned long long timestamp, period;
+          std::vector<CallchainElem> callchain;
+
+          try {
+            unsigned char frame_type = parser.get<unsigned char>();
+
+            if (frame_type == FRAME_STOP) {
+              break;
+            } else if (frame_type == FRAME_MESSAGE) {
+              line = parser.get_rest();
+            } else if (frame_type == FRAME_SAMPLE) {
+              if (!this->profile_start_set) {
+                continue;
+              }
+
+              pid = std::to_string(parser.get<std::int32_t>());
+              tid = std::to_string(parser.get<std::int32_t>());
+              timestamp = parser.get<std::uint64_t>();
+              period = parser.get<std::uint64_t>();
+              event_type = parser.get_string(parser.get<std::uint8_t>());
+
+              std::uint32_t callchain_size = parser.get<std::uint32_t>();
+
+              for (std::uint32_t i = 0; i < callchain_size; i++) {
+                std::uint32_t symbol = parser.get<std::uint32_t>();
+                std::uint64_t offset = parser.get<std::uint64_t>();
+                callchain.push_back(std::make_pair(symbol, offset));
+              }
+            } else {
+              adaptyst_print(this->module_id, ("Binary frame of unknown type " +
+                                               std::to_string(frame_type) + " received from profiler \"" +
+                                               profiler->get_name() + "\", ignoring.").c_str(),
+                             true, false, "General");
+              continue;
+            }
+          } catch (std::out_of_range &) {
+            adaptyst_print(this->module_id, ("Binary frame received from profiler \"" +
+                                             profiler->get_name() + "\" is truncated, ignoring.").c_str(),
+                           true, false, "General");
+            continue;
+          }
+
+          if (!event_type.empty()) {
+            if (this->map_symbol_codes(symbol_ids, callchain, profiler)) {
+              this->demux_sample(sample_states, dir, event_dirs, profiler,
+                                 event_type, pid, tid, timestamp, period,
+                                 callchain);
+              this->record_sample(result.telemetry, timestamp);
+            }
+
+            continue;
+          }
+        } else {
+          states_lock.unlock();
+          line = connection->read();
+          states_lock.lock();
+
+          this->record_read(result.telemetry, read_start);
+
+          if (line == "<STOP>") {
+            break;
+          }
+        }
+
         if (line.empty()) {
           continue;
         }
@@ -392,21 +1407,45 @@ private:
                              true, false, "General");
               result.perf_maps_expected = true;
             }
-          } else if (parsed["type"] == "callchains") {
-            if (!parsed["data"].is_object()) {
-              adaptyst_print(this->module_id, ("Message received from profiler \"" +
-                                               profiler->get_name() + "\" "
-                                               "is a JSON object of type \"callchains\", "
-                                               "but its \"data\" "
-                                               "element is not a JSON object, ignoring.").c_str(), true, false, "General");
+          } else if (parsed["type"] == "symbol") {
+            nlohmann::json obj = parsed["data"];
+            std::uint32_t code;
+            std::string name, dso;
+
+            try {
+              code = obj["code"];
+              name = obj["name"];
+              dso = obj["dso"];
+            } catch (...) {
+              adaptyst_print(this->module_id, "The recently received symbol JSON is invalid, ignoring.",
+                             true, false, "General");
               continue;
             }
 
-            File callchain_file(dir, "callchains", ".json");
-            if (!(callchain_file.get_ostream()
-                  << parsed["data"].dump() << std::endl)) {
-              adaptyst_print(this->module_id, "Could not write data to callchains.json",
-                             true, true, "General");
+            if (code >= symbol_ids.size()) {
+              symbol_ids.resize(code + 1, UINT32_MAX);
+            }
+
+            symbol_ids[code] = this->symbol_table.intern(name, dso);
+          } else if (parsed["type"] == "release" || parsed["type"] == "takeover") {
+            std::string pid, tid, move;
+
+            try {
+              pid = parsed["data"]["pid"];
+              tid = parsed["data"]["tid"];
+              move = parsed["data"]["move"];
+            } catch (...) {
+              adaptyst_print(this->module_id, ("The recently received " +
+                                               parsed["type"].get<std::string>() +
+                                               " JSON is invalid, ignoring.").c_str(),
+                             true, false, "General");
+              continue;
+            }
+
+            if (parsed["type"] == "release") {
+              this->release_thread(sample_states, handover, pid, tid, move);
+            } else {
+              this->take_over_thread(sample_states, handover, profiler, pid, tid, move);
             }
           } else if (parsed["type"] == "sources") {
             if (!parsed["data"].is_object()) {
@@ -429,21 +1468,19 @@ private:
                 continue;
               }
 
-              if (fs::exists(elem.key())) {
-                if (result.dso_offsets.find(elem.key()) == result.dso_offsets.end()) {
-                  result.dso_offsets[elem.key()] = std::unordered_set<std::string>();
-                }
+              std::unordered_set<std::uint64_t> offsets;
 
-                for (auto &offset : elem.value()) {
-                  result.dso_offsets[elem.key()].insert(offset);
-                }
+              for (auto &offset : elem.value()) {
+                offsets.insert(offset.get<std::uint64_t>());
               }
+
+              this->source_resolver->add(elem.key(), offsets);
             }
           } else if (parsed["type"] == "sample" && this->profile_start_set) {
             nlohmann::json obj = parsed["data"];
             std::string event_type, pid, tid;
             unsigned long long timestamp, period;
-            std::vector<std::pair<std::string, std::string> > callchain;
+            std::vector<CallchainElem> callchain;
             try {
               event_type = obj["event_type"];
               pid = obj["pid"];
@@ -451,98 +1488,59 @@ private:
               timestamp = obj["time"];
               period = obj["period"];
               callchain = obj["callchain"].template get<
-                std::vector<std::pair<std::string, std::string> > >();
+                std::vector<CallchainElem> >();
             } catch (...) {
               adaptyst_print(this->module_id, "The recently received sample JSON is invalid, ignoring.",
                              true, false, "General");
               continue;
             }
 
-            if (!first_event_received) {
-              first_event_received = true;
-
-              if (event_type == "offcpu-time" || event_type == "task-clock") {
-                extra_event_name = "";
-
-                if (timestamp - period < this->profile_start) {
-                  period = timestamp - this->profile_start;
-                }
-              } else {
-                extra_event_name = event_type;
-              }
-            } else if ((extra_event_name != "" && event_type != extra_event_name) ||
-                       (extra_event_name == "" && event_type != "offcpu-time" && event_type != "task-clock")) {
-              adaptyst_print(this->module_id, ("The recently received sample JSON is of different event type than expected "
-                                               "(received: " + event_type + ", expected: " +
-                                               (extra_event_name == "" ? "task-clock or offcpu-time" : extra_event_name) +
-                                               "), ignoring.").c_str(), true, false, "General");
-              continue;
+            if (this->map_symbol_codes(symbol_ids, callchain, profiler)) {
+              this->demux_sample(sample_states, dir, event_dirs, profiler,
+                                 event_type, pid, tid, timestamp, period,
+                                 callchain);
+              this->record_sample(result.telemetry, timestamp);
             }
-
-            Path pid_tid_dir = dir / pid / tid;
-
-            if (event_type == "offcpu-time") {
-              Array<std::pair<
-                unsigned long long, unsigned long long> > offcpu(pid_tid_dir, "offcpu");
-
-              if (timestamp - this->profile_start - period < 0) {
-                offcpu.push_back({0, timestamp - this->profile_start});
-              } else {
-                offcpu.push_back(
-                                 {timestamp - this->profile_start - period, period});
+          } else if (parsed["type"] == "telemetry") {
+            result.telemetry.script_data = parsed["data"];
+          } else if (parsed["type"] == "losses") {
+            try {
+              for (auto &elem : parsed["data"]) {
+                result.losses.push_back(PerfLoss{elem["event_type"], elem["pid"], elem["tid"],
+                                                 elem["lost"], elem["throttles"]});
               }
+            } catch (...) {
+              adaptyst_print(this->module_id, "The recently received losses JSON is invalid, ignoring.",
+                             true, false, "General");
+              continue;
             }
-
-            std::string pid_tid = pid + "_" + tid;
-
-            if (untimed_data_map.find(pid_tid) == untimed_data_map.end()) {
-              untimed_data_map[pid_tid] = nlohmann::json::object();
-              untimed_data_map[pid_tid]["name"] = "all";
-              untimed_data_map[pid_tid]["children"] = nlohmann::json::object();
-              untimed_data_map[pid_tid]["cold_value"] = 0;
-              untimed_data_map[pid_tid]["hot_value"] = 0;
-              untimed_data_map[pid_tid]["value"] = 0;
-              untimed_data_map[pid_tid]["pid"] = pid;
-              untimed_data_map[pid_tid]["tid"] = tid;
-            }
-
-            if (timed_data_map.find(pid_tid) == timed_data_map.end()) {
-              timed_data_map[pid_tid] = nlohmann::json::object();
-              timed_data_map[pid_tid]["name"] = "all";
-              timed_data_map[pid_tid]["children"] = nlohmann::json::array();
-              timed_data_map[pid_tid]["cold_value"] = 0;
-              timed_data_map[pid_tid]["hot_value"] = 0;
-              timed_data_map[pid_tid]["value"] = 0;
-              timed_data_map[pid_tid]["pid"] = pid;
-              timed_data_map[pid_tid]["tid"] = tid;
-            }
-
-            this->save_sample(&untimed_data_map[pid_tid], callchain,
-                              period, false, event_type == "offcpu-time");
-            this->save_sample(&timed_data_map[pid_tid], callchain,
-                              period, true, event_type == "offcpu-time");
-
-            pid_tid_dir.set_metadata<
-              unsigned long long>("sampled_period",
-                                  pid_tid_dir.get_metadata<
-                                  unsigned long long>("sampled_period", 0) + period);
           } else if (parsed["type"] == "syscall") {
             thread_tree_connection = true;
 
             nlohmann::json obj = parsed["data"];
             std::string ret_value;
-            std::vector<std::pair<std::string, std::string> > callchain;
+            std::vector<CallchainElem> callchain;
 
             try {
               ret_value = obj["ret_value"];
               callchain = obj["callchain"].template get<
-                std::vector<std::pair<std::string, std::string> > >();
+                std::vector<CallchainElem> >();
             } catch (...) {
               std::cerr << "The recently-received syscall JSON is invalid, ignoring." << std::endl;
               continue;
             }
 
-            tid_dict[ret_value] = callchain;
+            if (!this->map_symbol_codes(symbol_ids, callchain, profiler)) {
+              continue;
+            }
+
+            std::vector<std::pair<std::string, std::string> > &spawning_callchain = tid_dict[ret_value];
+            spawning_callchain.clear();
+
+            for (auto &elem : callchain) {
+              spawning_callchain.push_back(std::make_pair(std::to_string(elem.first),
+                                                          offset_to_string(elem.second)));
+            }
           } else if (parsed["type"] == "syscall_meta") {
             thread_tree_connection = true;
 
@@ -606,6 +1604,20 @@ private:
       result.exception = e;
     }
 
+    result.telemetry.end = ch::steady_clock::now();
+
+    if (states_lock.owns_lock()) {
+      states_lock.unlock();
+    }
+
+    checkpointer.stop();
+
+    if (!generic) {
+      std::lock_guard<std::mutex> lock(handover.mutex);
+      handover.active_connections--;
+      handover.released.notify_all();
+    }
+
     if (thread_tree_connection) {
       nlohmann::json json_tree = nlohmann::json::object();
 
@@ -671,86 +1683,372 @@ private:
         }
       }
 
-      File thread_tree_file(dir, "threads", ".json");
-      if (!(thread_tree_file.get_ostream() << json_tree.dump() << std::endl)) {
+      File thread_tree_file(dir, "threads", this->get_extension(".json"));
+      if (!this->write_result(thread_tree_file.get_ostream(),
+                              [&json_tree](std::ostream &output) {
+                                return (bool)(output << json_tree.dump() << std::endl);
+                              })) {
         adaptyst_print(this->module_id, "Could not write data to threads.json", true, true,
                        "General");
       }
     } else {
-      for (auto &entry : untimed_data_map) {
-        nlohmann::json &obj = entry.second;
-        std::string pid = obj["pid"];
-        std::string tid = obj["tid"];
+      this->record_result_sizes(result.telemetry, sample_states);
+      this->write_sample_trees(sample_states);
+    }
 
-        obj.erase("pid");
-        obj.erase("tid");
+    this->timed_memory_usage -= timed_memory_usage;
 
-        std::deque<nlohmann::json *> elem_queue;
-        elem_queue.push_back(&obj);
+    return result;
+  }
 
-        while (!elem_queue.empty()) {
-          nlohmann::json *elem_ptr = elem_queue.front();
-          nlohmann::json &elem = *elem_ptr;
+  ConnectionResult process_raw_stream(Path &dir,
+                                      std::unordered_map<std::string, Path> &event_dirs,
+                                      std::unique_ptr<Profiler> &profiler) {
+    ConnectionResult result;
+    result.perf_maps_expected = false;
+    result.error = false;
 
-          elem["children_tmp"] = nlohmann::json::array();
+    PerfDataReader *reader = profiler->get_raw_reader();
+    Symbolizer &symbolizer = reader->get_symbolizer();
+    std::unordered_map<std::string, SampleState> sample_states;
 
-          for (auto &entry : elem["children"].items()) {
-            elem["children_tmp"].push_back(nlohmann::json::object());
-            elem["children_tmp"][elem["children_tmp"].size() - 1].swap(entry.value());
-          }
+    PerfSample sample;
+    std::vector<CallchainElem> callchain;
 
-          elem["children"].swap(elem["children_tmp"]);
-          elem.erase("children_tmp");
+    // Offsets are passed to the source resolver in batches while
+    // profiling is still running.
+    std::unordered_map<std::string, std::unordered_set<std::uint64_t> > dso_offsets;
+    std::size_t dso_offset_count = 0;
 
-          for (auto &entry : elem["children"]) {
-            elem_queue.push_back(&entry);
-          }
+    auto flush_dso_offsets = [this, &dso_offsets, &dso_offset_count]() {
+      for (auto &elem : dso_offsets) {
+        this->source_resolver->add(elem.first, elem.second);
+      }
 
-          elem_queue.pop_front();
+      dso_offsets.clear();
+      dso_offset_count = 0;
+    };
+
+    // sample_states is guarded by states_mutex from the checkpoints
+    // of the connection, except while waiting for a sample.
+    std::mutex states_mutex;
+    PeriodicTask checkpointer(this->checkpoint_interval,
+                              [this, &sample_states, &states_mutex]() {
+                                this->checkpoint(sample_states, states_mutex);
+                              });
+    std::unique_lock<std::mutex> states_lock(states_mutex);
+
+    std::size_t sample_count = 0;
+    std::size_t timed_memory_usage = 0;
+    std::size_t next_compaction = 0;
+
+    try {
+      while (true) {
+        ch::steady_clock::time_point read_start = ch::steady_clock::now();
+
+        states_lock.unlock();
+        bool sample_read = reader->read(sample);
+        states_lock.lock();
+
+        if (!sample_read) {
+          break;
         }
 
-        fs::path path = fs::path(dir.get_path_name()) / pid / tid / "untimed.json";
-        std::ofstream stream(path);
+        this->record_read(result.telemetry, read_start);
 
-        if (!stream) {
-          throw std::runtime_error(("Could not open " + path.string() + " for writing").c_str());
+        if (!this->profile_start_set) {
+          continue;
         }
 
-        stream << obj.dump() << std::endl;
+        this->limit_timed_memory(sample_states, sample_count, timed_memory_usage,
+                                 next_compaction);
+
+        callchain.clear();
 
-        if (!stream) {
-          throw std::runtime_error(("Could not write to " + path.string() + ". Do you have "
-                                    "enough disk space?").c_str());
+        for (auto it = sample.callchain.rbegin(); it != sample.callchain.rend(); it++) {
+          const Frame &frame = symbolizer.symbolize(sample.pid, *it);
+
+          if (frame.dso_offset && dso_offsets[frame.dso].insert(frame.offset).second) {
+            dso_offset_count++;
+          }
+
+          callchain.push_back(std::make_pair(this->symbol_table.intern(frame.symbol, frame.dso),
+                                             frame.offset));
         }
-      }
 
-      for (auto &entry : timed_data_map) {
-        nlohmann::json &obj = entry.second;
-        std::string pid = obj["pid"];
-        std::string tid = obj["tid"];
+        if (callchain.empty()) {
+          callchain.push_back(std::make_pair(this->symbol_table.intern("(just thread/process)", ""),
+                                             NO_OFFSET));
+        }
 
-        obj.erase("pid");
-        obj.erase("tid");
+        std::string pid = std::to_string(sample.pid);
+        std::string tid = std::to_string(sample.tid);
 
-        fs::path path = fs::path(dir.get_path_name()) / pid / tid / "timed.json";
-        std::ofstream stream(path);
+        this->demux_sample(sample_states, dir, event_dirs, profiler,
+                           sample.event_type, pid, tid, sample.time,
+                           sample.period, callchain);
 
-        if (!stream) {
-          throw std::runtime_error(("Could not open " + path.string() + " for writing").c_str());
+        for (auto &value : sample.group_values) {
+          this->demux_sample(sample_states, dir, event_dirs, profiler,
+                             value.first, pid, tid, sample.time,
+                             value.second, callchain);
         }
 
-        stream << obj.dump() << std::endl;
+        this->record_sample(result.telemetry, sample.time);
 
-        if (!stream) {
-          throw std::runtime_error(("Could not write to " + path.string() + ". Do you have "
-                                    "enough disk space?").c_str());
+        if (dso_offset_count >= SOURCE_BATCH_SIZE) {
+          flush_dso_offsets();
         }
       }
+    } catch (std::runtime_error &e) {
+      adaptyst_print(this->module_id, ("Profiler \"" + profiler->get_name() + "\" has produced "
+                                       "output which could not be decoded: " +
+                                       std::string(e.what())).c_str(), true, true, "General");
+    }
+
+    result.telemetry.end = ch::steady_clock::now();
+    result.losses = reader->get_losses();
+    flush_dso_offsets();
+
+    if (states_lock.owns_lock()) {
+      states_lock.unlock();
     }
 
+    checkpointer.stop();
+
+    for (auto &perf_map_path : symbolizer.get_missing_perf_maps()) {
+      adaptyst_print(this->module_id, ("A symbol map is expected in " +
+                                       fs::absolute(perf_map_path).string() +
+                                       ", but it hasn't been found!").c_str(),
+                     true, false, "General");
+      result.perf_maps_expected = true;
+    }
+
+    this->record_result_sizes(result.telemetry, sample_states);
+    this->write_sample_trees(sample_states);
+    this->timed_memory_usage -= timed_memory_usage;
+
     return result;
   }
 
+  /**
+     Checks whether profilers attach to already running processes
+     instead of the command run by Adaptyst.
+  */
+  bool attaching() {
+    return !this->attach_target.pids.empty() || !this->attach_target.cgroup.empty();
+  }
+
+  /**
+     Gets the PIDs of the processes being attached to, i.e. the PIDs
+     in attach_pids or the processes currently in attach_cgroup.
+  */
+  std::vector<pid_t> get_attached_pids() {
+    std::vector<pid_t> pids = this->attach_target.pids;
+
+    if (!this->attach_cgroup_path.empty()) {
+      std::ifstream procs(this->attach_cgroup_path / "cgroup.procs");
+      pid_t pid;
+
+      while (procs >> pid) {
+        pids.push_back(pid);
+      }
+    }
+
+    return pids;
+  }
+
+  /**
+     Checks whether any process being attached to is still running.
+  */
+  bool attached_processes_running() {
+    for (pid_t pid : this->get_attached_pids()) {
+      if (fs::exists(fs::path("/proc") / std::to_string(pid))) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+     Lists the threads of the processes being attached to, which have
+     been created before profiling and will never have fork events in
+     the thread tree profiler, from /proc. Every thread is listed after
+     its parent: the parent of a process is its parent process if that
+     is attached to as well and the parent of any other thread is its
+     process.
+  */
+  void list_attached_threads() {
+    std::vector<pid_t> pids = this->get_attached_pids();
+    std::unordered_set<pid_t> pid_set(pids.begin(), pids.end());
+    std::unordered_map<pid_t, std::vector<pid_t> > children;
+    std::vector<pid_t> roots;
+
+    for (pid_t pid : pids) {
+      // The parent PID is the second field after the command name,
+      // which may contain spaces and parentheses.
+      std::ifstream stat_file(fs::path("/proc") / std::to_string(pid) / "stat");
+      std::string stat((std::istreambuf_iterator<char>(stat_file)),
+                       std::istreambuf_iterator<char>());
+      std::size_t comm_end = stat.rfind(')');
+      pid_t ppid = 0;
+
+      if (comm_end != std::string::npos) {
+        std::istringstream fields(stat.substr(comm_end + 1));
+        std::string state;
+        fields >> state >> ppid;
+      }
+
+      if (ppid != pid && pid_set.find(ppid) != pid_set.end()) {
+        children[ppid].push_back(pid);
+      } else {
+        roots.push_back(pid);
+      }
+    }
+
+    this->attached_threads.clear();
+
+    std::vector<std::pair<pid_t, std::string> > queue;
+
+    for (pid_t pid : roots) {
+      queue.push_back(std::make_pair(pid, ""));
+    }
+
+    for (std::size_t i = 0; i < queue.size(); i++) {
+      auto [pid, parent] = queue[i];
+      std::string pid_str = std::to_string(pid);
+      fs::path task_dir = fs::path("/proc") / pid_str / "task";
+
+      auto get_comm = [&task_dir](std::string tid) {
+        std::ifstream comm_file(task_dir / tid / "comm");
+        std::string comm;
+        std::getline(comm_file, comm);
+        return comm;
+      };
+
+      this->attached_threads.push_back(AttachedThread{pid_str, pid_str, parent,
+                                                      get_comm(pid_str)});
+
+      std::error_code error;
+
+      for (auto &entry : fs::directory_iterator(task_dir, error)) {
+        std::string tid = entry.path().filename().string();
+
+        if (tid != pid_str) {
+          this->attached_threads.push_back(AttachedThread{pid_str, tid, pid_str,
+                                                          get_comm(tid)});
+        }
+      }
+
+      for (pid_t child : children[pid]) {
+        queue.push_back(std::make_pair(child, pid_str));
+      }
+    }
+  }
+
+  /**
+     Waits for the end of profiling processes being attached to, i.e.
+     for attach_duration to elapse, for "stop" to be received through
+     the control named pipe, for all the processes to exit or for
+     workflow to finish, whichever comes first. Profilers are then
+     stopped and the command run by Adaptyst (with PID command_pid) is
+     terminated if it is still running.
+  */
+  void wait_for_attach_end(std::vector<std::pair<std::unique_ptr<Profiler>, Path> > &profilers,
+                           std::future<void> &workflow, pid_t command_pid) {
+    ch::steady_clock::time_point deadline =
+      ch::steady_clock::now() + ch::seconds(this->attach_duration);
+
+    while (workflow.wait_for(100ms) == std::future_status::timeout) {
+      const char *reason = nullptr;
+
+      if (this->attach_stop_requested) {
+        reason = "Profiling has been stopped through \"control_fifo\".";
+      } else if (this->attach_duration > 0 && ch::steady_clock::now() >= deadline) {
+        reason = "\"attach_duration\" has elapsed, stopping profiling.";
+      } else if (!this->attached_processes_running()) {
+        reason = "All processes attached to have exited, stopping profiling.";
+      }
+
+      if (reason) {
+        adaptyst_print(this->module_id, reason, true, false, "General");
+        kill(command_pid, SIGTERM);
+        break;
+      }
+    }
+
+    for (auto &pair : profilers) {
+      Perf *perf = dynamic_cast<Perf *>(pair.first.get());
+
+      if (perf) {
+        perf->stop();
+      }
+    }
+  }
+
+  /**
+     Listens for "pause"/"resume" commands in the control named pipe
+     and forwards them to all profilers until stop is set. A "stop"
+     command ends profiling of processes being attached to (see
+     wait_for_attach_end()).
+  */
+  void listen_control_fifo(std::vector<std::pair<std::unique_ptr<Profiler>, Path> > &profilers,
+                           int fd, std::atomic<bool> &stop) {
+    std::string pending;
+    char buf[256];
+
+    while (!stop) {
+      struct pollfd fds = {fd, POLLIN, 0};
+
+      if (poll(&fds, 1, 100) <= 0) {
+        continue;
+      }
+
+      int bytes = read(fd, buf, sizeof(buf));
+
+      if (bytes <= 0) {
+        continue;
+      }
+
+      pending.append(buf, bytes);
+
+      std::size_t pos;
+
+      while ((pos = pending.find('\n')) != std::string::npos) {
+        std::string command = pending.substr(0, pos);
+        pending.erase(0, pos + 1);
+        boost::trim(command);
+
+        if (command == "pause" || command == "resume") {
+          for (auto &pair : profilers) {
+            if (command == "pause") {
+              pair.first->pause();
+            } else {
+              pair.first->resume();
+            }
+          }
+
+          adaptyst_print(this->module_id, ("Event capturing has been " +
+                                           std::string(command == "pause" ? "paused." : "resumed.")).c_str(),
+                         true, false, "General");
+        } else if (command == "stop") {
+          if (this->attaching()) {
+            this->attach_stop_requested = true;
+          } else {
+            adaptyst_print(this->module_id, "\"stop\" received through \"control_fifo\" "
+                           "is supported only when attaching to running processes, "
+                           "ignoring.", true, false, "General");
+          }
+        } else if (!command.empty()) {
+          adaptyst_print(this->module_id, ("Unknown command \"" + command + "\" received "
+                                           "through \"control_fifo\", ignoring.").c_str(),
+                         true, false, "General");
+        }
+      }
+    }
+  }
+
 public:
   static CPULinuxModule *instance;
 
@@ -771,6 +2069,22 @@ public:
     option *capture_mode_opt = adaptyst_get_option(this->module_id, "capture_mode");
     option *perf_path_opt = adaptyst_get_option(this->module_id, "perf_path");
     option *perf_script_path_opt = adaptyst_get_option(this->module_id, "perf_script_path");
+    option *wire_format_opt = adaptyst_get_option(this->module_id, "wire_format");
+    option *native_decoder_opt = adaptyst_get_option(this->module_id, "native_decoder");
+    option *merge_events_opt = adaptyst_get_option(this->module_id, "merge_events");
+    option *group_read_opt = adaptyst_get_option(this->module_id, "group_read");
+    option *start_paused_opt = adaptyst_get_option(this->module_id, "start_paused");
+    option *control_fifo_opt = adaptyst_get_option(this->module_id, "control_fifo");
+    option *checkpoint_interval_opt = adaptyst_get_option(this->module_id, "checkpoint_interval");
+    option *timed_memory_limit_opt = adaptyst_get_option(this->module_id, "timed_memory_limit");
+    option *attach_pids_opt = adaptyst_get_option(this->module_id, "attach_pids");
+    option *attach_cgroup_opt = adaptyst_get_option(this->module_id, "attach_cgroup");
+    option *attach_duration_opt = adaptyst_get_option(this->module_id, "attach_duration");
+    option *loss_warning_threshold_opt = adaptyst_get_option(this->module_id,
+                                                             "loss_warning_threshold");
+#ifdef LIBZSTD_AVAILABLE
+    option *compression_level_opt = adaptyst_get_option(this->module_id, "compression_level");
+#endif
 
     unsigned int buf_size = *(unsigned int *)buf_size_opt->data;
     unsigned int warmup = *(unsigned int *)warmup_opt->data;
@@ -790,6 +2104,26 @@ public:
     std::string filter_str(*((const char **)filter_opt->data));
     bool mark = *(bool *)mark_opt->data;
     std::string capture_mode(*(const char **)capture_mode_opt->data);
+    std::string wire_format(*(const char **)wire_format_opt->data);
+    bool native_decoder = *(bool *)native_decoder_opt->data;
+    bool merge_events = *(bool *)merge_events_opt->data;
+    bool group_read = *(bool *)group_read_opt->data;
+    bool start_paused = *(bool *)start_paused_opt->data;
+    std::string control_fifo(*(const char **)control_fifo_opt->data);
+    unsigned int checkpoint_interval = *(unsigned int *)checkpoint_interval_opt->data;
+    unsigned int timed_memory_limit = *(unsigned int *)timed_memory_limit_opt->data;
+
+    std::vector<std::string> attach_pid_strs;
+    if (attach_pids_opt->len > 0) {
+      const char **attach_pid_cstrs = *(const char ***)attach_pids_opt->data;
+      for (unsigned int i = 0; i < attach_pids_opt->len; i++) {
+        attach_pid_strs.push_back(std::string(attach_pid_cstrs[i]));
+      }
+    }
+
+    std::string attach_cgroup(*(const char **)attach_cgroup_opt->data);
+    unsigned int attach_duration = *(unsigned int *)attach_duration_opt->data;
+    unsigned int loss_warning_threshold = *(unsigned int *)loss_warning_threshold_opt->data;
 
     std::string cpu_mask(adaptyst_get_cpu_mask(this->module_id));
     CPUConfig cpu_config(cpu_mask);
@@ -1092,6 +2426,131 @@ public:
       return false;
     }
 
+    if (wire_format == "binary") {
+      this->wire_format = Profiler::BINARY;
+    } else if (wire_format == "json") {
+      this->wire_format = Profiler::JSON;
+    } else {
+      adaptyst_set_error(this->module_id, "\"wire_format\" can be either \"binary\" or \"json\".");
+      return false;
+    }
+
+    if (native_decoder && this->filter.mode != Perf::FilterMode::NONE) {
+      adaptyst_print(this->module_id, "\"native_decoder\" is not compatible with \"filter\", "
+                     "perf-script will be used instead.", true, false, "General");
+      native_decoder = false;
+    }
+
+    this->native_decoder = native_decoder;
+    this->merge_events = merge_events;
+
+    if (group_read) {
+      std::unordered_set<std::string> event_types = {"task-clock", "offcpu-time"};
+
+      for (auto &event : this->events) {
+        if (!event_types.insert(event.get_type()).second) {
+          adaptyst_set_error(this->module_id, ("\"group_read\" requires extra events to have "
+                                               "unique types other than task-clock and offcpu-time, "
+                                               "but " + event.get_type() + " is repeated.").c_str());
+          return false;
+        }
+      }
+    }
+
+    this->group_read = group_read;
+
+    if (start_paused && control_fifo.empty()) {
+      adaptyst_set_error(this->module_id, "\"start_paused\" requires \"control_fifo\" to be set, "
+                         "otherwise nothing would be profiled.");
+      return false;
+    }
+
+    this->start_paused = start_paused;
+    this->control_fifo_path = control_fifo;
+    this->checkpoint_interval = checkpoint_interval;
+    this->timed_memory_limit = (std::size_t)timed_memory_limit << 20;
+
+    if (!attach_pid_strs.empty() && !attach_cgroup.empty()) {
+      adaptyst_set_error(this->module_id, "\"attach_pids\" and \"attach_cgroup\" cannot be "
+                         "used together.");
+      return false;
+    }
+
+    std::unordered_set<pid_t> attach_pids;
+
+    for (auto &pid_str : attach_pid_strs) {
+      pid_t pid;
+
+      try {
+        std::size_t parsed;
+        pid = std::stoi(pid_str, &parsed);
+
+        if (parsed != pid_str.size() || pid <= 0) {
+          throw std::invalid_argument(pid_str);
+        }
+      } catch (std::logic_error &) {
+        adaptyst_set_error(this->module_id, ("\"" + pid_str + "\" in \"attach_pids\" "
+                                             "is not a valid PID.").c_str());
+        return false;
+      }
+
+      if (!fs::exists(fs::path("/proc") / std::to_string(pid))) {
+        adaptyst_set_error(this->module_id, ("Process " + std::to_string(pid) + " in "
+                                             "\"attach_pids\" is not running!").c_str());
+        return false;
+      }
+
+      if (attach_pids.insert(pid).second) {
+        this->attach_target.pids.push_back(pid);
+      }
+    }
+
+    if (!attach_cgroup.empty()) {
+      // The cgroup v2 hierarchy is tried first, followed by
+      // the cgroup v1 perf_event one.
+      for (fs::path root : {"/sys/fs/cgroup", "/sys/fs/cgroup/perf_event"}) {
+        if (fs::exists(root / attach_cgroup / "cgroup.procs")) {
+          this->attach_cgroup_path = root / attach_cgroup;
+          break;
+        }
+      }
+
+      if (this->attach_cgroup_path.empty()) {
+        adaptyst_set_error(this->module_id, ("Cgroup \"" + attach_cgroup + "\" in "
+                                             "\"attach_cgroup\" does not exist!").c_str());
+        return false;
+      }
+
+      this->attach_target.cgroup = attach_cgroup;
+    }
+
+    if (attach_duration > 0 && !this->attaching()) {
+      adaptyst_set_error(this->module_id, "\"attach_duration\" requires \"attach_pids\" "
+                         "or \"attach_cgroup\" to be set.");
+      return false;
+    }
+
+    this->attach_duration = attach_duration;
+
+    if (loss_warning_threshold > 100) {
+      adaptyst_set_error(this->module_id, "\"loss_warning_threshold\" must be between 0 and 100.");
+      return false;
+    }
+
+    this->loss_warning_threshold = loss_warning_threshold;
+
+#ifdef LIBZSTD_AVAILABLE
+    unsigned int compression_level = *(unsigned int *)compression_level_opt->data;
+
+    if (compression_level <= (unsigned int)ZSTD_maxCLevel()) {
+      this->compression_level = compression_level;
+    } else {
+      adaptyst_set_error(this->module_id, ("\"compression_level\" must be between 0 and " +
+                                           std::to_string(ZSTD_maxCLevel()) + ".").c_str());
+      return false;
+    }
+#endif
+
     this->cpu_config = cpu_config;
 
     fs::path perf_path(*(const char **)perf_path_opt->data);
@@ -1167,7 +2626,8 @@ public:
       PerfEvent main(this->freq,
                      this->off_cpu_freq,
                      this->buffer,
-                     this->off_cpu_buffer);
+                     this->off_cpu_buffer,
+                     this->group_read ? this->events : std::vector<PerfEvent>());
       PerfEvent syscall_tree;
 
       PipeAcceptor::Factory generic_acceptor_factory;
@@ -1182,7 +2642,9 @@ public:
                                                   this->cpu_config,
                                                   "Thread tree profiler",
                                                   this->capture_mode,
-                                                  this->filter), module_dir});
+                                                  this->filter,
+                                                  Profiler::JSON), module_dir});
+      Profiler *thread_tree_profiler = profilers.back().first.get();
 
       Path walltime_dir = module_dir / "walltime";
       walltime_dir.set_metadata<std::string>("title", "Wall time");
@@ -1196,7 +2658,37 @@ public:
                                                   main, this->cpu_config,
                                                   "On-CPU/Off-CPU profiler",
                                                   this->capture_mode,
-                                                  this->filter), walltime_dir});
+                                                  this->filter,
+                                                  this->native_decoder ?
+                                                  Profiler::RAW : this->wire_format), walltime_dir});
+
+      // Samples of a profiler sampling multiple events at once are
+      // split between the directories of the events by event type.
+      std::unordered_map<Profiler *, std::unordered_map<std::string, Path> > event_dirs;
+
+      // Threads being moved between connections of a profiler
+      std::unordered_map<Profiler *, ThreadHandover> handovers;
+
+      // With group reading, extra events are read by the on-CPU/off-CPU
+      // profiler instead of being sampled by their own profilers.
+      std::unordered_map<std::string, Path> *group_event_dirs = nullptr;
+
+      if (this->group_read && !this->events.empty()) {
+        group_event_dirs = &event_dirs[profilers.back().first.get()];
+        group_event_dirs->emplace("task-clock", walltime_dir);
+        group_event_dirs->emplace("offcpu-time", walltime_dir);
+      }
+
+      // Events are merged only if their event types are unique, as
+      // their samples couldn't be told apart otherwise.
+      std::unordered_map<std::string, int> event_type_counts;
+
+      for (auto &event : this->events) {
+        event_type_counts[event.get_type()]++;
+      }
+
+      std::vector<PerfEvent> merged_events;
+      std::unordered_map<std::string, Path> merged_event_dirs;
 
       for (auto &event : this->events) {
         Path metric_dir = module_dir / event.get_name();
@@ -1204,6 +2696,34 @@ public:
                                              event.get_human_title());
         metric_dir.set_metadata<std::string>("unit",
                                              event.get_unit());
+
+        if (group_event_dirs) {
+          group_event_dirs->emplace(event.get_type(), metric_dir);
+          continue;
+        }
+
+        if (this->merge_events && event_type_counts[event.get_type()] == 1) {
+          merged_events.push_back(event);
+          merged_event_dirs.emplace(event.get_type(), metric_dir);
+          continue;
+        }
+
+        profilers.push_back({std::make_unique<Perf>(generic_acceptor_factory,
+                                                    this->buf_size,
+                                                    this->perf_bin_path,
+                                                    this->perf_python_path,
+                                                    this->perf_script_path,
+                                                    event,
+                                                    this->cpu_config,
+                                                    event.get_name(),
+                                                    this->capture_mode,
+                                                    this->filter,
+                                                    this->native_decoder ?
+                                                    Profiler::RAW : this->wire_format), metric_dir});
+      }
+
+      if (merged_events.size() == 1) {
+        PerfEvent &event = merged_events[0];
         profilers.push_back({std::make_unique<Perf>(generic_acceptor_factory,
                                                     this->buf_size,
                                                     this->perf_bin_path,
@@ -1213,7 +2733,25 @@ public:
                                                     this->cpu_config,
                                                     event.get_name(),
                                                     this->capture_mode,
-                                                    this->filter), metric_dir});
+                                                    this->filter,
+                                                    this->native_decoder ?
+                                                    Profiler::RAW : this->wire_format),
+                             merged_event_dirs.begin()->second});
+      } else if (merged_events.size() > 1) {
+        PerfEvent multi_event(merged_events);
+        profilers.push_back({std::make_unique<Perf>(generic_acceptor_factory,
+                                                    this->buf_size,
+                                                    this->perf_bin_path,
+                                                    this->perf_python_path,
+                                                    this->perf_script_path,
+                                                    multi_event,
+                                                    this->cpu_config,
+                                                    "Extra event profiler",
+                                                    this->capture_mode,
+                                                    this->filter,
+                                                    this->native_decoder ?
+                                                    Profiler::RAW : this->wire_format), module_dir});
+        event_dirs[profilers.back().first.get()] = merged_event_dirs;
       }
 
 #if defined(ADAPTYST_ROOFLINE) && defined(BOOST_ARCH_X86) && defined(BOOST_COMP_GNUC)
@@ -1236,6 +2774,16 @@ public:
       }
 #endif
 
+      if (this->attaching()) {
+        for (auto &pair : profilers) {
+          Perf *perf = dynamic_cast<Perf *>(pair.first.get());
+
+          if (perf) {
+            perf->set_target(this->attach_target);
+          }
+        }
+      }
+
       for (int i = 0; i < profilers.size() && requirements_fulfilled; i++) {
         std::vector<std::unique_ptr<Requirement> > &requirements = profilers[i].first->get_requirements();
 
@@ -1253,20 +2801,59 @@ public:
       adaptyst_print(this->module_id, "Starting profilers and waiting for them to signal their "
                      "readiness...", false, false, "General");
 
+      this->source_resolver = std::make_unique<SourceResolver>(
+        this->cpu_config.get_profiler_thread_count(),
+        fs::path(adaptyst_get_local_config_dir(this->module_id)) / "source_cache");
+
       profile_info *profile = adaptyst_get_profile_info(this->module_id);
       std::vector<std::future<ConnectionResult> > threads;
+      std::vector<std::size_t> thread_profilers;
+
+      if (this->attaching()) {
+        this->list_attached_threads();
+      }
 
       int index = 0;
 
-      for (auto &pair : profilers) {
-        auto &profiler = pair.first;
-        auto &dir = pair.second;
+      for (std::size_t i = 0; i < profilers.size(); i++) {
+        auto &profiler = profilers[i].first;
+        auto &dir = profilers[i].second;
+        auto &profiler_event_dirs = event_dirs[profiler.get()];
+        auto &handover = handovers[profiler.get()];
+
+        profiler->start(profile->data.pid, !this->start_paused);
+
+        if (profiler->get_raw_reader()) {
+          threads.push_back(std::async([this, &dir, &profiler_event_dirs, &profiler]() {
+            return this->process_raw_stream(dir, profiler_event_dirs, profiler);
+          }));
+          thread_profilers.push_back(i);
+          index++;
+          continue;
+        }
 
-        profiler->start(profile->data.pid, true);
+        handover.active_connections = profiler->get_connections().size() - 1;
+
+        bool generic = true;
+        bool first_event_connection = true;
         for (auto &connection : profiler->get_connections()) {
-          threads.push_back(std::async([this, &dir, &profiler, &connection]() {
-            return this->process_connection(dir, profiler, connection);
+          // event-handler.py sends all fork/exit events through its
+          // first event stream, i.e. the first non-generic connection.
+          bool thread_tree = !generic && first_event_connection &&
+            profiler.get() == thread_tree_profiler;
+
+          if (!generic) {
+            first_event_connection = false;
+          }
+
+          threads.push_back(std::async([this, &dir, &profiler_event_dirs, &handover,
+                                        &profiler, &connection, generic, thread_tree]() {
+            return this->process_connection(dir, profiler_event_dirs, handover,
+                                            profiler, connection, generic,
+                                            thread_tree);
           }));
+          thread_profilers.push_back(i);
+          generic = false;
           index++;
         }
       }
@@ -1277,6 +2864,61 @@ public:
 
       adaptyst_print(this->module_id, "The warmup has been completed.", true, false, "General");
 
+      // The control named pipe is opened for both reading and writing
+      // so that it never reports EOF when a writer closes it.
+      int control_fd = -1;
+      bool control_fifo_created = false;
+      std::atomic<bool> control_stop = false;
+      std::future<void> control_listener;
+
+      auto stop_control_listener = [&]() {
+        if (control_fd == -1) {
+          return;
+        }
+
+        control_stop = true;
+        control_listener.get();
+        close(control_fd);
+        control_fd = -1;
+
+        if (control_fifo_created) {
+          std::error_code error;
+          fs::remove(this->control_fifo_path, error);
+        }
+      };
+
+      if (!this->control_fifo_path.empty()) {
+        if (!fs::exists(this->control_fifo_path)) {
+          if (mkfifo(this->control_fifo_path.c_str(), 0600) == -1) {
+            adaptyst_set_error(this->module_id, ("Could not create " +
+                                                 this->control_fifo_path.string() + "!").c_str());
+            return false;
+          }
+
+          control_fifo_created = true;
+        }
+
+        control_fd = open(this->control_fifo_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+        if (control_fd == -1) {
+          adaptyst_set_error(this->module_id, ("Could not open " +
+                                               this->control_fifo_path.string() + "!").c_str());
+          return false;
+        }
+
+        control_listener = std::async(std::launch::async,
+                                      [this, &profilers, control_fd, &control_stop]() {
+                                        this->listen_control_fifo(profilers, control_fd,
+                                                                  control_stop);
+                                      });
+
+        adaptyst_print(this->module_id, ("Event capturing can be paused and resumed by writing "
+                                         "\"pause\" and \"resume\" to " +
+                                         this->control_fifo_path.string() +
+                                         (this->start_paused ? " (it is paused now)." : ".")).c_str(),
+                       true, false, "General");
+      }
+
       adaptyst_profile_notify(this->module_id);
 
       unsigned long long timestamp = adaptyst_get_workflow_start_time(this->module_id);
@@ -1284,30 +2926,59 @@ public:
       if (adaptyst_get_internal_error_code(this->module_id) != ADAPTYST_OK) {
         adaptyst_set_error(this->module_id, "Calling adaptyst_get_workflow_start_time() to get the profile start "
                            "timestamp has failed!");
+        stop_control_listener();
         return false;
       }
 
       this->profile_start = timestamp;
       this->profile_start_set = true;
 
-      adaptyst_profile_wait(this->module_id);
+      if (this->attaching()) {
+        std::future<void> workflow = std::async(std::launch::async, [this]() {
+          adaptyst_profile_wait(this->module_id);
+        });
+
+        this->wait_for_attach_end(profilers, workflow, profile->data.pid);
+        workflow.get();
+      } else {
+        adaptyst_profile_wait(this->module_id);
+      }
+
+      stop_control_listener();
 
       adaptyst_print(this->module_id, "Finishing processing results...", false, false, "General");
 
-      std::vector<
-        std::unordered_map<std::string, std::unordered_set<std::string> > > dso_offsets;
       bool perf_maps_expected = false;
-      int dso_offsets_size = 0;
 
-      for (auto &thread : threads) {
-        ConnectionResult result = thread.get();
+      // The overhead of every connection is saved along with
+      // the results, so that it can be told apart from the behaviour
+      // of the profiled program.
+      nlohmann::json telemetry = nlohmann::json::object();
+      telemetry["profilers"] = nlohmann::json::object();
+
+      std::vector<unsigned long long> profiler_samples(profilers.size(), 0);
+      std::vector<std::vector<PerfLoss> > profiler_losses(profilers.size());
+
+      for (int i = 0; i < threads.size(); i++) {
+        ConnectionResult result = threads[i].get();
+        std::size_t profiler_index = thread_profilers[i];
 
         if (result.perf_maps_expected) {
           perf_maps_expected = true;
         }
 
-        dso_offsets.push_back(result.dso_offsets);
-        dso_offsets_size += result.dso_offsets.size();
+        telemetry["profilers"][profilers[profiler_index].first->get_name()]["connections"].push_back(
+          this->telemetry_to_json(result.telemetry));
+
+        profiler_samples[profiler_index] += result.telemetry.samples;
+        profiler_losses[profiler_index].insert(profiler_losses[profiler_index].end(),
+                                               result.losses.begin(), result.losses.end());
+      }
+
+      for (std::size_t i = 0; i < profilers.size(); i++) {
+        this->record_losses(profilers[i].first, profilers[i].second,
+                            event_dirs[profilers[i].first.get()],
+                            profiler_samples[i], profiler_losses[i]);
       }
 
       bool profiler_error = false;
@@ -1324,74 +2995,49 @@ public:
         return false;
       }
 
-      nlohmann::json sources_json = nlohmann::json::object();
-
-      // The number of threads needs to stay at 1 here because of a bug
-      // (a race condition?) causing randomly addr2line not to terminate after
-      // the stdin pipe is closed.
-      //
-      // TODO: fix this
-      boost::asio::thread_pool pool(1);
-
-      std::pair<std::string, nlohmann::json> sources[dso_offsets_size];
-      std::unordered_set<fs::path> source_files[dso_offsets_size];
-
-      index = 0;
-
-      for (auto &map : dso_offsets) {
-        for (auto &elem : map) {
-          auto process_func = [index, elem, this, &sources, &source_files]() {
-            std::vector<std::string> cmd = {"addr2line", "-e", elem.first};
-            Process process(cmd);
-            process.start(false, this->cpu_config, true);
-
-            nlohmann::json result;
-            std::unordered_set<fs::path> files;
-
-            for (auto &offset : elem.second) {
-              std::string to_write = offset + '\n';
-              process.write_stdin((char *)to_write.c_str(), to_write.size());
-              std::vector<std::string> parts;
-              boost::split(parts, process.read_line(), boost::is_any_of(":"));
-
-              if (parts.size() == 2) {
-                try {
-                  result[offset] = nlohmann::json::object();
-                  result[offset]["file"] = parts[0];
-                  result[offset]["line"] = std::stoi(parts[1]);
-                  files.insert(parts[0]);
-                } catch (...) {
-                }
-              }
-            }
-
-            sources[index] = std::make_pair(elem.first, result);
-            source_files[index] = files;
-          };
-
-          boost::asio::post(pool, process_func);
-          index++;
-        }
+      // ru_maxrss is in KiB. For children, it is the peak of
+      // the largest one, e.g. perf-script.
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      telemetry["peak_rss"] = (unsigned long long)usage.ru_maxrss * 1024;
+      getrusage(RUSAGE_CHILDREN, &usage);
+      telemetry["peak_profiler_rss"] = (unsigned long long)usage.ru_maxrss * 1024;
+
+      try {
+        this->write_result_file(fs::path(adaptyst_get_module_dir(this->module_id)) /
+                                this->get_extension("telemetry.json"),
+                                [&telemetry](std::ostream &output) {
+                                  return (bool)(output << telemetry.dump() << std::endl);
+                                });
+      } catch (std::exception &e) {
+        adaptyst_set_error(this->module_id, e.what());
+        return false;
       }
 
-      pool.join();
-
-      std::unordered_set<fs::path> src_paths;
-
-      for (int i = 0; i < dso_offsets_size; i++) {
-        if (!sources_json.contains(sources[i].first)) {
-          sources_json[sources[i].first] = nlohmann::json::object();
-        }
+      // callchains.json may already be there from a checkpoint,
+      // so it is replaced atomically.
+      try {
+        this->write_result_file(fs::path(adaptyst_get_module_dir(this->module_id)) /
+                                this->get_extension("callchains.json"),
+                                [this](std::ostream &output) {
+                                  return (bool)(output << this->symbol_table.to_json().dump()
+                                                << std::endl);
+                                });
+      } catch (std::exception &e) {
+        adaptyst_set_error(this->module_id, e.what());
+        return false;
+      }
 
-        sources_json[sources[i].first].swap(sources[i].second);
+      // Most offsets have already been resolved while profiling,
+      // only the tail is left here.
+      this->source_resolver->wait();
 
-        for (auto &elem : source_files[i]) {
-          src_paths.insert(elem);
-        }
-      }
+      nlohmann::json sources_json = this->source_resolver->to_json();
+      std::unordered_set<fs::path> &src_paths = this->source_resolver->get_source_files();
 
       {
-        fs::path sources_file_path = fs::path(adaptyst_get_module_dir(this->module_id)) / "sources.json";
+        fs::path sources_file_path = fs::path(adaptyst_get_module_dir(this->module_id)) /
+          this->get_extension("sources.json");
         std::ofstream sources_file(sources_file_path);
 
         if (!sources_file) {
@@ -1400,7 +3046,9 @@ public:
           return false;
         }
 
-        if (!(sources_file << sources_json.dump() << std::endl)) {
+        if (!this->write_result(sources_file, [&sources_json](std::ostream &output) {
+              return (bool)(output << sources_json.dump() << std::endl);
+            })) {
           adaptyst_set_error(this->module_id,
                              ("Could not write data to " + sources_file_path.string()).c_str());
           return false;
@@ -0,0 +1,803 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "linuxperf_dwarf.hpp"
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <elf.h>
+
+#define DW_LNS_copy 1
+#define DW_LNS_advance_pc 2
+#define DW_LNS_advance_line 3
+#define DW_LNS_set_file 4
+#define DW_LNS_const_add_pc 8
+#define DW_LNS_fixed_advance_pc 9
+
+#define DW_LNE_end_sequence 1
+#define DW_LNE_set_address 2
+#define DW_LNE_define_file 3
+
+#define DW_LNCT_path 1
+#define DW_LNCT_directory_index 2
+
+#define DW_FORM_block2 0x03
+#define DW_FORM_block4 0x04
+#define DW_FORM_data2 0x05
+#define DW_FORM_data4 0x06
+#define DW_FORM_data8 0x07
+#define DW_FORM_string 0x08
+#define DW_FORM_block 0x09
+#define DW_FORM_block1 0x0a
+#define DW_FORM_data1 0x0b
+#define DW_FORM_strp 0x0e
+#define DW_FORM_udata 0x0f
+#define DW_FORM_data16 0x1e
+#define DW_FORM_line_strp 0x1f
+
+namespace adaptyst {
+  /**
+     A cursor over a DWARF section. Reading past the end
+     of the section sets the error flag instead of throwing.
+  */
+  class DwarfCursor {
+  private:
+    const std::string &data;
+    std::size_t pos;
+    std::size_t end;
+
+  public:
+    bool error;
+
+    DwarfCursor(const std::string &data, std::size_t pos,
+                std::size_t end) : data(data) {
+      this->pos = pos;
+      this->end = std::min(end, data.size());
+      this->error = pos > this->end;
+    }
+
+    std::size_t get_pos() {
+      return this->pos;
+    }
+
+    void seek(std::size_t pos) {
+      this->pos = pos;
+      this->error = this->error || pos > this->end;
+    }
+
+    bool at_end() {
+      return this->error || this->pos >= this->end;
+    }
+
+    std::uint64_t read(int bytes) {
+      if (this->error || this->end - this->pos < (std::size_t)bytes) {
+        this->error = true;
+        return 0;
+      }
+
+      std::uint64_t result = 0;
+
+      // Only little-endian files are supported (see LineTable::read_elf()).
+      for (int i = 0; i < bytes; i++) {
+        result |= (std::uint64_t)(unsigned char)this->data[this->pos + i] << (8 * i);
+      }
+
+      this->pos += bytes;
+      return result;
+    }
+
+    std::uint64_t read_uleb() {
+      std::uint64_t result = 0;
+      int shift = 0;
+
+      while (true) {
+        std::uint64_t byte = this->read(1);
+
+        if (this->error) {
+          return 0;
+        }
+
+        if (shift < 64) {
+          result |= (byte & 0x7f) << shift;
+        }
+
+        shift += 7;
+
+        if (!(byte & 0x80)) {
+          return result;
+        }
+      }
+    }
+
+    std::int64_t read_sleb() {
+      std::int64_t result = 0;
+      int shift = 0;
+      std::uint64_t byte;
+
+      do {
+        byte = this->read(1);
+
+        if (this->error) {
+          return 0;
+        }
+
+        if (shift < 64) {
+          result |= (std::int64_t)(byte & 0x7f) << shift;
+        }
+
+        shift += 7;
+      } while (byte & 0x80);
+
+      if (shift < 64 && (byte & 0x40)) {
+        result |= -((std::int64_t)1 << shift);
+      }
+
+      return result;
+    }
+
+    std::string read_string() {
+      std::size_t null_pos = this->data.find('\0', this->pos);
+
+      if (this->error || null_pos == std::string::npos || null_pos >= this->end) {
+        this->error = true;
+        return "";
+      }
+
+      std::string result = this->data.substr(this->pos, null_pos - this->pos);
+      this->pos = null_pos + 1;
+      return result;
+    }
+
+    void skip(std::uint64_t bytes) {
+      if (this->error || this->end - this->pos < bytes) {
+        this->error = true;
+        return;
+      }
+
+      this->pos += bytes;
+    }
+  };
+
+  static std::string string_at(const std::string &section, std::uint64_t offset) {
+    if (offset >= section.size()) {
+      return "";
+    }
+
+    return std::string(section.c_str() + offset);
+  }
+
+  /**
+     Reads an attribute of a DWARF 5 directory/file entry. Returns
+     whether the form is supported.
+
+     @param string_value  Where the value should be stored if
+                          the form is a string one.
+     @param numeric_value Where the value should be stored if
+                          the form is a numeric one.
+  */
+  static bool read_form(DwarfCursor &cursor, std::uint64_t form, int offset_size,
+                        const std::string &debug_line_str,
+                        const std::string &debug_str,
+                        std::string &string_value,
+                        std::uint64_t &numeric_value) {
+    switch (form) {
+    case DW_FORM_string:
+      string_value = cursor.read_string();
+      break;
+
+    case DW_FORM_line_strp:
+      string_value = string_at(debug_line_str, cursor.read(offset_size));
+      break;
+
+    case DW_FORM_strp:
+      string_value = string_at(debug_str, cursor.read(offset_size));
+      break;
+
+    case DW_FORM_udata:
+      numeric_value = cursor.read_uleb();
+      break;
+
+    case DW_FORM_data1:
+      numeric_value = cursor.read(1);
+      break;
+
+    case DW_FORM_data2:
+      numeric_value = cursor.read(2);
+      break;
+
+    case DW_FORM_data4:
+      numeric_value = cursor.read(4);
+      break;
+
+    case DW_FORM_data8:
+      numeric_value = cursor.read(8);
+      break;
+
+    case DW_FORM_data16:
+      cursor.skip(16);
+      break;
+
+    case DW_FORM_block:
+      cursor.skip(cursor.read_uleb());
+      break;
+
+    case DW_FORM_block1:
+      cursor.skip(cursor.read(1));
+      break;
+
+    case DW_FORM_block2:
+      cursor.skip(cursor.read(2));
+      break;
+
+    case DW_FORM_block4:
+      cursor.skip(cursor.read(4));
+      break;
+
+    default:
+      return false;
+    }
+
+    return !cursor.error;
+  }
+
+  /**
+     Joins a directory and a file name the same way as addr2line does.
+     An empty string is returned if the result would be a relative
+     path.
+  */
+  static std::string join_path(const std::string &dir, const std::string &file) {
+    if (!file.empty() && file[0] == '/') {
+      return file;
+    }
+
+    if (dir.empty() || dir[0] != '/') {
+      return "";
+    }
+
+    return dir.back() == '/' ? dir + file : dir + "/" + file;
+  }
+
+  /**
+     Gets the GNU build ID from the contents of a note section
+     as a hexadecimal string (or an empty string if there is none).
+  */
+  static std::string build_id_from_notes(const std::string &data) {
+    std::size_t pos = 0;
+
+    while (pos + sizeof(Elf64_Nhdr) <= data.size()) {
+      Elf64_Nhdr nhdr;
+      std::memcpy(&nhdr, data.data() + pos, sizeof(nhdr));
+      pos += sizeof(nhdr);
+
+      std::size_t name_size = (nhdr.n_namesz + 3) & ~3;
+      std::size_t desc_size = (nhdr.n_descsz + 3) & ~3;
+
+      if (pos + name_size + nhdr.n_descsz > data.size()) {
+        break;
+      }
+
+      if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+          std::memcmp(data.data() + pos, "GNU", 4) == 0) {
+        std::string result;
+
+        for (std::size_t i = 0; i < nhdr.n_descsz; i++) {
+          char hex[3];
+          std::snprintf(hex, sizeof(hex), "%02x",
+                        (unsigned char)data[pos + name_size + i]);
+          result += hex;
+        }
+
+        return result;
+      }
+
+      pos += name_size + desc_size;
+    }
+
+    return "";
+  }
+
+  /**
+     Gets the GNU build ID of an ELF file as a hexadecimal string
+     (or an empty string if there is none) without reading anything
+     else, which is much cheaper than constructing a LineTable object.
+  */
+  std::string LineTable::read_build_id(fs::path path) {
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      return "";
+    }
+
+    Elf64_Ehdr ehdr;
+
+    if (!stream.read((char *)&ehdr, sizeof(ehdr)) ||
+        std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr.e_ident[EI_DATA] != ELFDATA2LSB) {
+      return "";
+    }
+
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+      Elf64_Phdr phdr;
+      stream.seekg(ehdr.e_phoff + i * ehdr.e_phentsize);
+
+      if (!stream.read((char *)&phdr, sizeof(phdr))) {
+        return "";
+      }
+
+      if (phdr.p_type == PT_NOTE) {
+        std::string data(phdr.p_filesz, '\0');
+        stream.seekg(phdr.p_offset);
+
+        if (!stream.read(data.data(), phdr.p_filesz)) {
+          return "";
+        }
+
+        std::string build_id = build_id_from_notes(data);
+
+        if (!build_id.empty()) {
+          return build_id;
+        }
+      }
+    }
+
+    return "";
+  }
+
+  /**
+     Constructs a LineTable object by reading the line tables of
+     a given ELF file (or its separate debug file).
+  */
+  LineTable::LineTable(fs::path path) {
+    this->state = NO_DEBUG_INFO;
+    std::string debuglink;
+
+    if (this->read_elf(path, true, debuglink) || this->state == UNSUPPORTED) {
+      return;
+    }
+
+    std::vector<fs::path> candidates;
+
+    if (this->build_id.size() > 2) {
+      candidates.push_back(fs::path("/usr/lib/debug/.build-id") /
+                           this->build_id.substr(0, 2) /
+                           (this->build_id.substr(2) + ".debug"));
+    }
+
+    if (!debuglink.empty()) {
+      fs::path dir = path.parent_path();
+      candidates.push_back(dir / debuglink);
+      candidates.push_back(dir / ".debug" / debuglink);
+      candidates.push_back(fs::path("/usr/lib/debug") / dir.relative_path() / debuglink);
+    }
+
+    for (auto &candidate : candidates) {
+      std::error_code error;
+
+      if (candidate != path && fs::is_regular_file(candidate, error) &&
+          (this->read_elf(candidate, false, debuglink) || this->state == UNSUPPORTED)) {
+        return;
+      }
+    }
+  }
+
+  /**
+     Reads the line tables of an ELF file. Returns whether they have
+     been read successfully, with the state set accordingly.
+
+     @param path      The path to the ELF file.
+     @param read_ids  Whether the build ID and .gnu_debuglink should
+                      be read.
+     @param debuglink Where the file name from .gnu_debuglink should be
+                      stored.
+  */
+  bool LineTable::read_elf(fs::path path, bool read_ids, std::string &debuglink) {
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      return false;
+    }
+
+    Elf64_Ehdr ehdr;
+
+    if (!stream.read((char *)&ehdr, sizeof(ehdr)) ||
+        std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr.e_ident[EI_DATA] != ELFDATA2LSB) {
+      return false;
+    }
+
+    std::vector<Elf64_Shdr> shdrs(ehdr.e_shnum);
+
+    for (int i = 0; i < ehdr.e_shnum; i++) {
+      stream.seekg(ehdr.e_shoff + i * ehdr.e_shentsize);
+
+      if (!stream.read((char *)&shdrs[i], sizeof(Elf64_Shdr))) {
+        return false;
+      }
+    }
+
+    if (ehdr.e_shstrndx >= shdrs.size()) {
+      return false;
+    }
+
+    auto read_section = [&stream](Elf64_Shdr &shdr, std::string &data) {
+      data.resize(shdr.sh_size);
+      stream.seekg(shdr.sh_offset);
+      return (bool)stream.read(data.data(), shdr.sh_size);
+    };
+
+    std::string shstrtab;
+
+    if (!read_section(shdrs[ehdr.e_shstrndx], shstrtab)) {
+      return false;
+    }
+
+    Elf64_Shdr *debug_line_shdr = nullptr;
+    Elf64_Shdr *debug_line_str_shdr = nullptr;
+    Elf64_Shdr *debug_str_shdr = nullptr;
+
+    for (auto &shdr : shdrs) {
+      std::string name = string_at(shstrtab, shdr.sh_name);
+
+      if (name == ".debug_line") {
+        debug_line_shdr = &shdr;
+      } else if (name == ".debug_line_str") {
+        debug_line_str_shdr = &shdr;
+      } else if (name == ".debug_str") {
+        debug_str_shdr = &shdr;
+      } else if (name == ".zdebug_line") {
+        this->state = UNSUPPORTED;
+        return false;
+      } else if (read_ids && name == ".gnu_debuglink") {
+        std::string data;
+
+        if (read_section(shdr, data)) {
+          debuglink = std::string(data.c_str());
+        }
+      } else if (read_ids && shdr.sh_type == SHT_NOTE && this->build_id.empty()) {
+        std::string data;
+
+        if (read_section(shdr, data)) {
+          this->build_id = build_id_from_notes(data);
+        }
+      }
+    }
+
+    if (!debug_line_shdr || debug_line_shdr->sh_type == SHT_NOBITS) {
+      return false;
+    }
+
+    for (Elf64_Shdr *shdr : {debug_line_shdr, debug_line_str_shdr, debug_str_shdr}) {
+      if (shdr && (shdr->sh_flags & SHF_COMPRESSED)) {
+        this->state = UNSUPPORTED;
+        return false;
+      }
+    }
+
+    std::string debug_line, debug_line_str, debug_str;
+
+    if (!read_section(*debug_line_shdr, debug_line) ||
+        (debug_line_str_shdr && !read_section(*debug_line_str_shdr, debug_line_str)) ||
+        (debug_str_shdr && !read_section(*debug_str_shdr, debug_str))) {
+      return false;
+    }
+
+    if (!this->parse(debug_line, debug_line_str, debug_str)) {
+      this->files.clear();
+      this->ranges.clear();
+      this->state = UNSUPPORTED;
+      return false;
+    }
+
+    this->state = READY;
+    return true;
+  }
+
+  /**
+     Runs all line number programs of .debug_line and stores the
+     resulting address ranges. Returns false if any program can't
+     be parsed.
+  */
+  bool LineTable::parse(const std::string &debug_line,
+                        const std::string &debug_line_str,
+                        const std::string &debug_str) {
+    std::size_t unit_start = 0;
+
+    while (unit_start < debug_line.size()) {
+      DwarfCursor header(debug_line, unit_start, debug_line.size());
+
+      int offset_size = 4;
+      std::uint64_t unit_length = header.read(4);
+
+      if (unit_length == 0xffffffff) {
+        offset_size = 8;
+        unit_length = header.read(8);
+      }
+
+      std::size_t unit_end = header.get_pos() + unit_length;
+
+      if (header.error || unit_end > debug_line.size()) {
+        return false;
+      }
+
+      DwarfCursor cursor(debug_line, header.get_pos(), unit_end);
+      unit_start = unit_end;
+
+      std::uint64_t version = cursor.read(2);
+
+      if (version < 2 || version > 5) {
+        return false;
+      }
+
+      int address_size = 8;
+
+      if (version >= 5) {
+        address_size = cursor.read(1);
+        cursor.read(1); // segment_selector_size
+      }
+
+      std::uint64_t header_length = cursor.read(offset_size);
+      std::size_t program_start = cursor.get_pos() + header_length;
+
+      std::uint64_t min_inst_length = cursor.read(1);
+
+      if (version >= 4) {
+        cursor.read(1); // maximum_operations_per_instruction
+      }
+
+      cursor.read(1); // default_is_stmt
+      std::int8_t line_base = (std::int8_t)cursor.read(1);
+      std::uint64_t line_range = cursor.read(1);
+      std::uint64_t opcode_base = cursor.read(1);
+
+      if (cursor.error || line_range == 0 || opcode_base == 0) {
+        return false;
+      }
+
+      std::vector<std::uint64_t> opcode_lengths(opcode_base, 0);
+
+      for (std::uint64_t i = 1; i < opcode_base; i++) {
+        opcode_lengths[i] = cursor.read(1);
+      }
+
+      std::vector<std::string> dirs;
+      std::vector<std::pair<std::string, std::uint64_t> > unit_files;
+
+      if (version >= 5) {
+        for (int table = 0; table < 2; table++) {
+          std::uint64_t format_count = cursor.read(1);
+          std::vector<std::pair<std::uint64_t, std::uint64_t> > format;
+
+          for (std::uint64_t i = 0; i < format_count; i++) {
+            std::uint64_t content_type = cursor.read_uleb();
+            std::uint64_t form = cursor.read_uleb();
+            format.push_back(std::make_pair(content_type, form));
+          }
+
+          std::uint64_t count = cursor.read_uleb();
+
+          for (std::uint64_t i = 0; i < count && !cursor.error; i++) {
+            std::string path;
+            std::uint64_t dir_index = 0;
+
+            for (auto &[content_type, form] : format) {
+              std::string string_value;
+              std::uint64_t numeric_value = 0;
+
+              if (!read_form(cursor, form, offset_size, debug_line_str, debug_str,
+                             string_value, numeric_value)) {
+                return false;
+              }
+
+              if (content_type == DW_LNCT_path) {
+                path = string_value;
+              } else if (content_type == DW_LNCT_directory_index) {
+                dir_index = numeric_value;
+              }
+            }
+
+            if (table == 0) {
+              dirs.push_back(path);
+            } else {
+              unit_files.push_back(std::make_pair(path, dir_index));
+            }
+          }
+        }
+      } else {
+        // Directory 0 is the compilation directory, which is not
+        // stored in .debug_line before DWARF 5.
+        dirs.push_back("");
+
+        while (true) {
+          std::string dir = cursor.read_string();
+
+          if (cursor.error || dir.empty()) {
+            break;
+          }
+
+          dirs.push_back(dir);
+        }
+
+        // File 0 doesn't exist before DWARF 5.
+        unit_files.push_back(std::make_pair("", 0));
+
+        while (true) {
+          std::string file = cursor.read_string();
+
+          if (cursor.error || file.empty()) {
+            break;
+          }
+
+          std::uint64_t dir_index = cursor.read_uleb();
+          cursor.read_uleb(); // modification time
+          cursor.read_uleb(); // file size
+          unit_files.push_back(std::make_pair(file, dir_index));
+        }
+      }
+
+      if (cursor.error) {
+        return false;
+      }
+
+      std::uint32_t files_base = this->files.size();
+      std::string comp_dir = version >= 5 && !dirs.empty() ? dirs[0] : "";
+
+      auto add_file = [&](std::string &name, std::uint64_t dir_index) {
+        std::string dir = dir_index < dirs.size() ? dirs[dir_index] : "";
+
+        if (!dir.empty() && dir[0] != '/' && !comp_dir.empty()) {
+          dir = join_path(comp_dir, dir);
+        }
+
+        this->files.push_back(join_path(dir, name));
+      };
+
+      for (auto &[name, dir_index] : unit_files) {
+        add_file(name, dir_index);
+      }
+
+      cursor.seek(program_start);
+
+      std::uint64_t address = 0;
+      std::uint64_t file = 1;
+      std::int64_t line = 1;
+      bool row_pending = false;
+      Range row = {0, 0, 0, 0};
+
+      auto emit_row = [&](bool end_sequence) {
+        if (row_pending && address > row.start) {
+          row.end = address;
+          this->ranges.push_back(row);
+        }
+
+        row_pending = !end_sequence;
+
+        if (row_pending) {
+          std::uint64_t index = files_base + file;
+          row = {address, 0,
+                 index < this->files.size() ? (std::uint32_t)index : UINT32_MAX,
+                 line > 0 ? (std::uint32_t)line : 0};
+        }
+      };
+
+      while (!cursor.at_end()) {
+        std::uint64_t opcode = cursor.read(1);
+
+        if (opcode >= opcode_base) {
+          std::uint64_t adjusted = opcode - opcode_base;
+          address += (adjusted / line_range) * min_inst_length;
+          line += line_base + (std::int64_t)(adjusted % line_range);
+          emit_row(false);
+        } else if (opcode == 0) {
+          std::uint64_t length = cursor.read_uleb();
+          std::size_t next = cursor.get_pos() + length;
+
+          if (length == 0) {
+            continue;
+          }
+
+          std::uint64_t extended = cursor.read(1);
+
+          if (extended == DW_LNE_end_sequence) {
+            emit_row(true);
+            address = 0;
+            file = 1;
+            line = 1;
+          } else if (extended == DW_LNE_set_address) {
+            address = cursor.read(length - 1 <= 8 ? length - 1 : address_size);
+          } else if (extended == DW_LNE_define_file) {
+            std::string name = cursor.read_string();
+            std::uint64_t dir_index = cursor.read_uleb();
+            add_file(name, dir_index);
+          }
+
+          cursor.seek(next);
+        } else if (opcode == DW_LNS_copy) {
+          emit_row(false);
+        } else if (opcode == DW_LNS_advance_pc) {
+          address += cursor.read_uleb() * min_inst_length;
+        } else if (opcode == DW_LNS_advance_line) {
+          line += cursor.read_sleb();
+        } else if (opcode == DW_LNS_set_file) {
+          file = cursor.read_uleb();
+        } else if (opcode == DW_LNS_const_add_pc) {
+          address += ((255 - opcode_base) / line_range) * min_inst_length;
+        } else if (opcode == DW_LNS_fixed_advance_pc) {
+          address += cursor.read(2);
+        } else {
+          for (std::uint64_t i = 0; i < opcode_lengths[opcode]; i++) {
+            cursor.read_uleb();
+          }
+        }
+      }
+
+      if (cursor.error) {
+        return false;
+      }
+    }
+
+    // Sequences of code removed by the linker are usually placed
+    // at address 0, so ranges starting there are dropped.
+    this->ranges.erase(std::remove_if(this->ranges.begin(), this->ranges.end(),
+                                      [](const Range &range) {
+                                        return range.start == 0;
+                                      }), this->ranges.end());
+
+    std::stable_sort(this->ranges.begin(), this->ranges.end(),
+                     [](const Range &a, const Range &b) {
+                       return a.start < b.start;
+                     });
+
+    return true;
+  }
+
+  /**
+     Gets the state of the line table.
+  */
+  LineTable::State LineTable::get_state() {
+    return this->state;
+  }
+
+  /**
+     Gets the build ID of the ELF file as a hexadecimal string
+     (or an empty string if there is none).
+  */
+  std::string &LineTable::get_build_id() {
+    return this->build_id;
+  }
+
+  /**
+     Resolves a virtual address to a source code location.
+
+     @param address The address to resolve.
+     @param file    Where the path to the source file should be stored.
+     @param line    Where the line number should be stored.
+  */
+  LineTable::LookupResult LineTable::lookup(std::uint64_t address,
+                                            std::string &file, int &line) {
+    auto it = std::upper_bound(this->ranges.begin(), this->ranges.end(), address,
+                               [](std::uint64_t address, const Range &range) {
+                                 return address < range.start;
+                               });
+
+    if (it == this->ranges.begin()) {
+      return NOT_FOUND;
+    }
+
+    it--;
+
+    if (address >= it->end || it->line == 0) {
+      return NOT_FOUND;
+    }
+
+    if (it->file == UINT32_MAX || this->files[it->file].empty()) {
+      return UNKNOWN;
+    }
+
+    file = this->files[it->file];
+    line = it->line;
+    return FOUND;
+  }
+};
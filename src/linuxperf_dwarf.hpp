@@ -0,0 +1,88 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef LINUXPERF_DWARF_HPP_
+#define LINUXPERF_DWARF_HPP_
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <cstdint>
+
+namespace adaptyst {
+  namespace fs = std::filesystem;
+
+  /**
+     A class describing the DWARF line tables (.debug_line) of
+     an ELF file, used for resolving virtual addresses to source code
+     locations without spawning addr2line.
+
+     If the ELF file has no line tables itself, separate debug files
+     are looked up by build ID and .gnu_debuglink the same way as
+     addr2line does by default. DWARF versions 2-5 are supported.
+  */
+  class LineTable {
+  public:
+    /**
+       The state of a line table.
+
+       * READY: The line tables have been read and lookup() can be used.
+       * NO_DEBUG_INFO: There is no line information at all, so
+         no address can be resolved (by addr2line either).
+       * UNSUPPORTED: The line information exists, but it can't be read
+         in-process (e.g. it is compressed), so addr2line should be
+         used instead.
+    */
+    enum State {
+      READY,
+      NO_DEBUG_INFO,
+      UNSUPPORTED
+    };
+
+    /**
+       The result of lookup().
+
+       * FOUND: The address has been resolved.
+       * NOT_FOUND: The address is not covered by any line table or
+         it has no line number.
+       * UNKNOWN: The address is covered, but the full path to its
+         source file can't be determined (e.g. DWARF 4 paths relative
+         to the compilation directory), so addr2line should be used
+         instead.
+    */
+    enum LookupResult {
+      FOUND,
+      NOT_FOUND,
+      UNKNOWN
+    };
+
+  private:
+    struct Range {
+      std::uint64_t start;
+      std::uint64_t end;
+      std::uint32_t file;
+      std::uint32_t line;
+    };
+
+    State state;
+    std::string build_id;
+    std::vector<std::string> files;
+    std::vector<Range> ranges;
+
+    bool read_elf(fs::path path, bool read_ids, std::string &debuglink);
+    bool parse(const std::string &debug_line,
+               const std::string &debug_line_str,
+               const std::string &debug_str);
+
+  public:
+    static std::string read_build_id(fs::path path);
+
+    LineTable(fs::path path);
+    State get_state();
+    std::string &get_build_id();
+    LookupResult lookup(std::uint64_t address, std::string &file,
+                        int &line);
+  };
+};
+
+#endif
@@ -0,0 +1,353 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "linuxperf_output.hpp"
+#include <cstdio>
+
+namespace adaptyst {
+  /**
+     Constructs a JsonWriter object.
+
+     @param stream The stream to write the document to.
+  */
+  JsonWriter::JsonWriter(std::ostream &stream) : stream(stream),
+                                                  after_key(false) {
+    this->buffer.reserve(BUFFER_SIZE + 4096);
+  }
+
+  /**
+     Puts a comma before a value or a key unless it is the first one
+     in the current object/array or the value follows a key.
+  */
+  void JsonWriter::separate() {
+    if (this->after_key) {
+      this->after_key = false;
+      return;
+    }
+
+    if (this->first_in_scope.empty()) {
+      return;
+    }
+
+    if (this->first_in_scope.back()) {
+      this->first_in_scope.back() = false;
+    } else {
+      this->buffer += ',';
+    }
+  }
+
+  void JsonWriter::write_string(const std::string &value) {
+    this->buffer += '"';
+
+    for (unsigned char c : value) {
+      switch (c) {
+      case '"':
+        this->buffer += "\\\"";
+        break;
+
+      case '\\':
+        this->buffer += "\\\\";
+        break;
+
+      case '\b':
+        this->buffer += "\\b";
+        break;
+
+      case '\f':
+        this->buffer += "\\f";
+        break;
+
+      case '\n':
+        this->buffer += "\\n";
+        break;
+
+      case '\r':
+        this->buffer += "\\r";
+        break;
+
+      case '\t':
+        this->buffer += "\\t";
+        break;
+
+      default:
+        if (c < 0x20) {
+          char escaped[7];
+          std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          this->buffer += escaped;
+        } else {
+          this->buffer += c;
+        }
+      }
+    }
+
+    this->buffer += '"';
+  }
+
+  void JsonWriter::begin_object() {
+    this->separate();
+    this->buffer += '{';
+    this->first_in_scope.push_back(true);
+  }
+
+  void JsonWriter::end_object() {
+    this->buffer += '}';
+    this->first_in_scope.pop_back();
+
+    if (this->buffer.size() >= BUFFER_SIZE) {
+      this->flush();
+    }
+  }
+
+  void JsonWriter::begin_array() {
+    this->separate();
+    this->buffer += '[';
+    this->first_in_scope.push_back(true);
+  }
+
+  void JsonWriter::end_array() {
+    this->buffer += ']';
+    this->first_in_scope.pop_back();
+  }
+
+  /**
+     Writes an object key. The following call must write
+     the corresponding value.
+  */
+  void JsonWriter::key(const std::string &key) {
+    this->separate();
+    this->write_string(key);
+    this->buffer += ':';
+    this->after_key = true;
+  }
+
+  void JsonWriter::value(std::uint64_t value) {
+    this->separate();
+    this->buffer += std::to_string(value);
+  }
+
+  void JsonWriter::value(const std::string &value) {
+    this->separate();
+    this->write_string(value);
+  }
+
+  /**
+     Writes the buffered part of the document to the output stream.
+     Returns whether the stream is still in a good state.
+  */
+  bool JsonWriter::flush() {
+    if (!this->buffer.empty()) {
+      this->stream.write(this->buffer.data(), this->buffer.size());
+      this->buffer.clear();
+    }
+
+    return (bool)this->stream;
+  }
+
+  /**
+     Writes the rest of the document followed by a newline and
+     flushes the output stream. Returns whether the whole document
+     has been written successfully.
+  */
+  bool JsonWriter::finish() {
+    this->buffer += '\n';
+    this->flush();
+    this->stream.flush();
+    return (bool)this->stream;
+  }
+};
+
+#ifdef LIBZSTD_AVAILABLE
+namespace adaptyst {
+  /**
+     Constructs a ZstdStreamBuf object and starts its
+     compression thread.
+
+     @param target The stream to write compressed data to.
+     @param level  The zstd compression level.
+  */
+  ZstdStreamBuf::ZstdStreamBuf(std::ostream &target, int level) : target(target) {
+    this->context = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(this->context, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(this->context, ZSTD_c_checksumFlag, 1);
+
+    this->finished = false;
+    this->failed = false;
+    this->chunk.resize(CHUNK_SIZE);
+    this->setp(this->chunk.data(), this->chunk.data() + this->chunk.size());
+
+    this->thread = std::thread([this]() {
+      this->compress();
+    });
+  }
+
+  ZstdStreamBuf::~ZstdStreamBuf() {
+    this->finish();
+    ZSTD_freeCCtx(this->context);
+  }
+
+  /**
+     Hands over the data written so far to the compression thread,
+     waiting if too many chunks are already queued. The data is
+     discarded if compression or writing has already failed.
+  */
+  void ZstdStreamBuf::submit_chunk() {
+    this->chunk.resize(this->pptr() - this->pbase());
+
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->chunk_taken.wait(lock, [this]() {
+        return this->chunks.size() < MAX_CHUNKS || this->failed;
+      });
+
+      if (!this->failed) {
+        this->chunks.push(std::move(this->chunk));
+      }
+    }
+
+    this->chunk_added.notify_one();
+
+    this->chunk = std::vector<char>(CHUNK_SIZE);
+    this->setp(this->chunk.data(), this->chunk.data() + this->chunk.size());
+  }
+
+  ZstdStreamBuf::int_type ZstdStreamBuf::overflow(int_type c) {
+    if (this->finished) {
+      return traits_type::eof();
+    }
+
+    this->submit_chunk();
+
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *this->pptr() = traits_type::to_char_type(c);
+      this->pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+  }
+
+  /**
+     Marks compression or writing as failed, so that no more data
+     is queued (see submit_chunk()).
+  */
+  void ZstdStreamBuf::set_failed() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->failed = true;
+    }
+
+    this->chunk_taken.notify_all();
+  }
+
+  /**
+     The body of the compression thread.
+
+     After a failure, chunks still queued are taken and discarded
+     until the stream is finished, so that a writer waiting in
+     submit_chunk() never blocks forever.
+  */
+  void ZstdStreamBuf::compress() {
+    std::vector<char> out(ZSTD_CStreamOutSize());
+
+    while (true) {
+      std::vector<char> input;
+      bool last;
+      bool failed;
+
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->chunk_added.wait(lock, [this]() {
+          return !this->chunks.empty() || this->finished;
+        });
+
+        if (!this->chunks.empty()) {
+          input = std::move(this->chunks.front());
+          this->chunks.pop();
+        }
+
+        last = this->finished && this->chunks.empty();
+        failed = this->failed;
+      }
+
+      this->chunk_taken.notify_one();
+
+      if (failed) {
+        if (last) {
+          return;
+        }
+
+        continue;
+      }
+
+      ZSTD_inBuffer in_buf = {input.data(), input.size(), 0};
+      ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+      bool done;
+
+      do {
+        ZSTD_outBuffer out_buf = {out.data(), out.size(), 0};
+        std::size_t remaining = ZSTD_compressStream2(this->context, &out_buf,
+                                                     &in_buf, mode);
+
+        if (ZSTD_isError(remaining)) {
+          this->set_failed();
+          break;
+        }
+
+        if (!this->failed && !this->target.write(out.data(), out_buf.pos)) {
+          this->set_failed();
+        }
+
+        done = last ? remaining == 0 : in_buf.pos == in_buf.size;
+      } while (!done);
+
+      if (last) {
+        return;
+      }
+    }
+  }
+
+  /**
+     Compresses the rest of the data, ends the zstd frame and waits
+     for the compression thread to finish. Returns whether all data
+     has been compressed and written successfully. Nothing can be
+     written afterwards.
+  */
+  bool ZstdStreamBuf::finish() {
+    if (!this->thread.joinable()) {
+      return !this->failed && this->target;
+    }
+
+    this->submit_chunk();
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->finished = true;
+    }
+
+    this->chunk_added.notify_one();
+    this->thread.join();
+    this->setp(nullptr, nullptr);
+    this->target.flush();
+
+    return !this->failed && this->target;
+  }
+
+  /**
+     Constructs a ZstdOstream object.
+
+     @param target The stream to write compressed data to.
+     @param level  The zstd compression level.
+  */
+  ZstdOstream::ZstdOstream(std::ostream &target, int level) :
+    std::ostream(nullptr), buf(target, level) {
+    this->rdbuf(&this->buf);
+  }
+
+  /**
+     See ZstdStreamBuf::finish().
+  */
+  bool ZstdOstream::finish() {
+    this->flush();
+    return this->buf.finish() && *this;
+  }
+};
+#endif
@@ -0,0 +1,114 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef LINUXPERF_OUTPUT_HPP_
+#define LINUXPERF_OUTPUT_HPP_
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+
+#ifdef LIBZSTD_AVAILABLE
+#include <streambuf>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <zstd.h>
+#endif
+
+namespace adaptyst {
+  /**
+     A class describing a streaming JSON writer.
+
+     Tokens are appended to an internal buffer which is flushed
+     to the output stream whenever it exceeds a fixed size, so
+     a document of any size is written with bounded memory. The
+     output is compact and identical to what nlohmann::json::dump()
+     produces for the same document, provided that object keys are
+     written in the sorted order.
+
+     A failure of the output stream is reported by flush() and
+     finish() returning false.
+  */
+  class JsonWriter {
+  private:
+    static constexpr std::size_t BUFFER_SIZE = 1 << 20;
+
+    std::ostream &stream;
+    std::string buffer;
+    std::vector<bool> first_in_scope;
+    bool after_key;
+
+    void separate();
+    void write_string(const std::string &value);
+
+  public:
+    JsonWriter(std::ostream &stream);
+    void begin_object();
+    void end_object();
+    void begin_array();
+    void end_array();
+    void key(const std::string &key);
+    void value(std::uint64_t value);
+    void value(const std::string &value);
+    bool flush();
+    bool finish();
+  };
+
+#ifdef LIBZSTD_AVAILABLE
+  /**
+     A class describing a stream buffer compressing everything written
+     to it with zstd and passing the result to another stream.
+
+     Data is handed over in chunks of CHUNK_SIZE bytes to a background
+     thread which does the compression and writing, so the producer
+     of the data is not slowed down by either. At most MAX_CHUNKS
+     chunks can be waiting for compression at the same time.
+  */
+  class ZstdStreamBuf : public std::streambuf {
+  private:
+    static constexpr std::size_t CHUNK_SIZE = 1 << 20;
+    static constexpr std::size_t MAX_CHUNKS = 4;
+
+    std::ostream &target;
+    ZSTD_CCtx *context;
+    std::vector<char> chunk;
+    std::queue<std::vector<char> > chunks;
+    std::mutex mutex;
+    std::condition_variable chunk_added;
+    std::condition_variable chunk_taken;
+    bool finished;
+    bool failed;
+    std::thread thread;
+
+    void submit_chunk();
+    void set_failed();
+    void compress();
+
+  protected:
+    int_type overflow(int_type c);
+
+  public:
+    ZstdStreamBuf(std::ostream &target, int level);
+    ~ZstdStreamBuf();
+    bool finish();
+  };
+
+  /**
+     A class describing an output stream compressing everything written
+     to it with zstd (see ZstdStreamBuf).
+  */
+  class ZstdOstream : public std::ostream {
+  private:
+    ZstdStreamBuf buf;
+
+  public:
+    ZstdOstream(std::ostream &target, int level);
+    bool finish();
+  };
+#endif
+};
+
+#endif
@@ -0,0 +1,1124 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "linuxperf_perf_data.hpp"
+#include "linuxperf_protocol.hpp"
+#include "linuxperf_symbols.hpp"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <cxxabi.h>
+
+// "PERFILE2" read as a little-endian 64-bit integer
+#define PERF_PIPE_MAGIC 0x32454c4946524550ULL
+
+#define MIN_PERF_DATA_BUFFER_SIZE 1048576
+
+namespace adaptyst {
+  // Record types synthesized by "perf" itself rather than the kernel,
+  // see tools/lib/perf/include/perf/event.h in the Linux source tree.
+  enum PerfUserRecordType {
+    USER_RECORD_HEADER_ATTR = 64,
+    USER_RECORD_HEADER_TRACING_DATA = 66,
+    USER_RECORD_AUXTRACE = 71,
+    USER_RECORD_COMPRESSED = 81
+  };
+
+  /**
+     A structure describing a buffer for demangled names, reused by
+     abi::__cxa_demangle() (which expands it with realloc() if needed)
+     instead of a new buffer being allocated and freed for every name.
+  */
+  struct DemangleBuffer {
+    char *data = nullptr;
+    std::size_t size = 0;
+
+    ~DemangleBuffer() {
+      std::free(this->data);
+    }
+  };
+
+  /**
+     Demangles a symbol name in the same way as perf-script
+     with --demangle does. A non-mangled name is returned unchanged.
+  */
+  static std::string demangle(const char *name) {
+    if (std::strncmp(name, "_Z", 2) != 0) {
+      return std::string(name);
+    }
+
+    static thread_local DemangleBuffer buffer;
+
+    int status;
+    char *demangled = abi::__cxa_demangle(name, buffer.data, &buffer.size, &status);
+
+    if (status != 0 || !demangled) {
+      return std::string(name);
+    }
+
+    buffer.data = demangled;
+    return std::string(demangled);
+  }
+
+  /**
+     Constructs an ElfFile object, reading the function symbols and the
+     loadable segments of an ELF file.
+
+     Only 64-bit ELF files are supported. If the file cannot be read or
+     is not a 64-bit ELF file, is_valid() returns false.
+
+     @param path The path to the ELF file.
+  */
+  ElfFile::ElfFile(fs::path path) {
+    this->valid = false;
+
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      return;
+    }
+
+    Elf64_Ehdr ehdr;
+
+    if (!stream.read((char *)&ehdr, sizeof(ehdr)) ||
+        std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+      return;
+    }
+
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+      Elf64_Phdr phdr;
+      stream.seekg(ehdr.e_phoff + i * ehdr.e_phentsize);
+
+      if (!stream.read((char *)&phdr, sizeof(phdr))) {
+        return;
+      }
+
+      if (phdr.p_type == PT_LOAD) {
+        this->segments.push_back({phdr.p_offset, phdr.p_vaddr, phdr.p_filesz});
+      }
+    }
+
+    std::vector<Elf64_Shdr> shdrs(ehdr.e_shnum);
+
+    for (int i = 0; i < ehdr.e_shnum; i++) {
+      stream.seekg(ehdr.e_shoff + i * ehdr.e_shentsize);
+
+      if (!stream.read((char *)&shdrs[i], sizeof(Elf64_Shdr))) {
+        return;
+      }
+    }
+
+    // .symtab is preferred as it is a superset of .dynsym, but
+    // stripped files have only the latter.
+    Elf64_Shdr *symtab = nullptr;
+
+    for (auto &shdr : shdrs) {
+      if (shdr.sh_type == SHT_SYMTAB) {
+        symtab = &shdr;
+        break;
+      } else if (shdr.sh_type == SHT_DYNSYM) {
+        symtab = &shdr;
+      }
+    }
+
+    if (symtab && symtab->sh_link < shdrs.size()) {
+      Elf64_Shdr &strtab = shdrs[symtab->sh_link];
+      this->strtab.resize(strtab.sh_size);
+
+      stream.seekg(strtab.sh_offset);
+
+      if (!stream.read(this->strtab.data(), strtab.sh_size)) {
+        return;
+      }
+
+      std::vector<Elf64_Sym> syms(symtab->sh_size / sizeof(Elf64_Sym));
+      stream.seekg(symtab->sh_offset);
+
+      if (!stream.read((char *)syms.data(), syms.size() * sizeof(Elf64_Sym))) {
+        return;
+      }
+
+      for (auto &sym : syms) {
+        unsigned char type = ELF64_ST_TYPE(sym.st_info);
+
+        if ((type == STT_FUNC || type == STT_GNU_IFUNC) &&
+            sym.st_shndx != SHN_UNDEF && sym.st_value != 0 &&
+            sym.st_name < this->strtab.size()) {
+          this->symbols.push_back({sym.st_value, sym.st_size, sym.st_name});
+        }
+      }
+
+      std::sort(this->symbols.begin(), this->symbols.end(),
+                [](const Symbol &a, const Symbol &b) {
+                  return a.addr < b.addr;
+                });
+    }
+
+    this->valid = true;
+  }
+
+  /**
+     Determines whether the ELF file has been read successfully.
+  */
+  bool ElfFile::is_valid() {
+    return this->valid;
+  }
+
+  /**
+     Converts an offset within the ELF file to a virtual address
+     as seen by the ELF symbol tables and addr2line. If the offset
+     does not belong to any loadable segment, it is returned unchanged.
+  */
+  std::uint64_t ElfFile::file_offset_to_address(std::uint64_t offset) {
+    for (auto &segment : this->segments) {
+      if (offset >= segment.offset && offset < segment.offset + segment.size) {
+        return offset - segment.offset + segment.vaddr;
+      }
+    }
+
+    return offset;
+  }
+
+  /**
+     Finds the demangled name of a function containing a given virtual
+     address. nullptr is returned if no function is found.
+
+     Symbols of size 0 are treated as spanning up to the next symbol.
+  */
+  const std::string *ElfFile::find_symbol(std::uint64_t addr) {
+    auto it = std::upper_bound(this->symbols.begin(), this->symbols.end(), addr,
+                               [](std::uint64_t addr, const Symbol &sym) {
+                                 return addr < sym.addr;
+                               });
+
+    if (it == this->symbols.begin()) {
+      return nullptr;
+    }
+
+    it--;
+
+    if (it->size > 0 && addr >= it->addr + it->size) {
+      return nullptr;
+    }
+
+    auto demangled_it = this->demangled.find(it->name);
+
+    if (demangled_it == this->demangled.end()) {
+      demangled_it = this->demangled.insert({it->name,
+                                             demangle(this->strtab.c_str() + it->name)}).first;
+    }
+
+    return &demangled_it->second;
+  }
+
+  /**
+     Constructs a PerfMap object. The map file is not read until
+     the first call to find_symbol().
+
+     @param path The path to the map file.
+  */
+  PerfMap::PerfMap(fs::path path) {
+    this->path = path;
+    this->loaded_size = 0;
+    this->exists = fs::exists(path);
+  }
+
+  /**
+     Determines whether the map file existed when the object was
+     constructed.
+  */
+  bool PerfMap::is_found() {
+    return this->exists;
+  }
+
+  /**
+     Reads all map entries appended to the map file since the last call.
+     Only complete lines are read, so that entries being
+     written by a runtime at the same time are not cut.
+
+     Returns true if any new entries have been read.
+  */
+  bool PerfMap::load() {
+    std::error_code error;
+    std::uintmax_t size = fs::file_size(this->path, error);
+
+    if (error || size <= this->loaded_size) {
+      return false;
+    }
+
+    std::ifstream stream(this->path, std::ios::binary);
+
+    if (!stream) {
+      return false;
+    }
+
+    std::string data(size - this->loaded_size, '\0');
+    stream.seekg(this->loaded_size);
+    stream.read(data.data(), data.size());
+    data.resize(stream.gcount());
+
+    std::size_t complete = data.rfind('\n');
+
+    if (complete == std::string::npos) {
+      return false;
+    }
+
+    this->loaded_size += complete + 1;
+
+    std::istringstream lines(data.substr(0, complete + 1));
+    std::string line;
+    std::size_t old_count = this->entries.size();
+
+    while (std::getline(lines, line)) {
+      char *end;
+      std::uint64_t start = std::strtoull(line.c_str(), &end, 16);
+
+      if (end == line.c_str() || *end != ' ') {
+        continue;
+      }
+
+      char *name;
+      std::uint64_t entry_size = std::strtoull(end, &name, 16);
+
+      if (name == end || *name != ' ') {
+        continue;
+      }
+
+      while (*name == ' ') {
+        name++;
+      }
+
+      this->entries.push_back({start, entry_size, name, false});
+    }
+
+    // Only the new entries are sorted and then merged with the old
+    // ones. Entries added later take precedence over earlier ones at
+    // the same address, which both stable sorting and merging preserve.
+    auto compare = [](const Entry &a, const Entry &b) {
+      return a.start < b.start;
+    };
+
+    std::stable_sort(this->entries.begin() + old_count, this->entries.end(),
+                     compare);
+    std::inplace_merge(this->entries.begin(), this->entries.begin() + old_count,
+                       this->entries.end(), compare);
+
+    return this->entries.size() > old_count;
+  }
+
+  /**
+     Finds the name of a symbol containing a given instruction address.
+     If the symbol is not found, the map file is checked for newly
+     appended entries before nullptr is returned.
+  */
+  const std::string *PerfMap::find_symbol(std::uint64_t ip) {
+    if (!this->exists) {
+      return nullptr;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+      auto it = std::upper_bound(this->entries.begin(), this->entries.end(), ip,
+                                 [](std::uint64_t ip, const Entry &entry) {
+                                   return ip < entry.start;
+                                 });
+
+      if (it != this->entries.begin()) {
+        it--;
+
+        if (ip < it->start + it->size) {
+          // Names are demangled only when they are needed for
+          // the first time, as most entries of large maps never are.
+          if (!it->demangled) {
+            it->name = demangle(it->name.c_str());
+            it->demangled = true;
+          }
+
+          return &it->name;
+        }
+      }
+
+      if (!this->load()) {
+        break;
+      }
+    }
+
+    return nullptr;
+  }
+
+  Symbolizer::Symbolizer() {
+    this->kernel_symbols_loaded = false;
+  }
+
+  /**
+     Registers a new executable memory mapping of a process.
+     Any mappings overlapping the new one are removed.
+
+     Anonymous mappings are associated with the "perf" symbol map
+     of a process, in the same way as "perf" does it.
+  */
+  void Symbolizer::add_mapping(std::int32_t pid, std::uint64_t start,
+                               std::uint64_t len, std::uint64_t pgoff,
+                               std::string filename) {
+    if (filename == "//anon" || filename.starts_with("/dev/zero") ||
+        filename.starts_with("/anon_hugepage")) {
+      filename = "/tmp/perf-" + std::to_string(pid) + ".map";
+    }
+
+    std::map<std::uint64_t, Mapping> &pid_mappings = this->mappings[pid];
+    auto it = pid_mappings.lower_bound(start);
+
+    if (it != pid_mappings.begin()) {
+      auto prev = std::prev(it);
+
+      if (prev->second.start + prev->second.len > start) {
+        pid_mappings.erase(prev);
+      }
+    }
+
+    while (it != pid_mappings.end() && it->first < start + len) {
+      it = pid_mappings.erase(it);
+    }
+
+    pid_mappings[start] = {start, len, pgoff, filename};
+    this->cache.erase(pid);
+  }
+
+  /**
+     Makes a new process inherit all memory mappings of its parent.
+  */
+  void Symbolizer::fork(std::int32_t parent_pid, std::int32_t child_pid) {
+    if (parent_pid == child_pid) {
+      return;
+    }
+
+    auto it = this->mappings.find(parent_pid);
+
+    if (it == this->mappings.end()) {
+      this->mappings.erase(child_pid);
+    } else {
+      this->mappings[child_pid] = it->second;
+    }
+
+    this->cache.erase(child_pid);
+  }
+
+  /**
+     Drops all memory mappings of a process which has just called exec().
+  */
+  void Symbolizer::exec(std::int32_t pid) {
+    this->mappings.erase(pid);
+    this->cache.erase(pid);
+  }
+
+  ElfFile *Symbolizer::get_elf_file(const std::string &filename) {
+    auto it = this->elf_files.find(filename);
+
+    if (it == this->elf_files.end()) {
+      it = this->elf_files.insert({filename, std::make_unique<ElfFile>(filename)}).first;
+    }
+
+    return it->second->is_valid() ? it->second.get() : nullptr;
+  }
+
+  PerfMap *Symbolizer::get_perf_map(const std::string &filename) {
+    auto it = this->perf_maps.find(filename);
+
+    if (it == this->perf_maps.end()) {
+      it = this->perf_maps.insert({filename, std::make_unique<PerfMap>(filename)}).first;
+    }
+
+    return it->second.get();
+  }
+
+  const std::string *Symbolizer::find_kernel_symbol(std::uint64_t ip) {
+    if (!this->kernel_symbols_loaded) {
+      this->kernel_symbols_loaded = true;
+
+      std::ifstream kallsyms("/proc/kallsyms");
+      std::string line;
+
+      while (std::getline(kallsyms, line)) {
+        std::istringstream parts(line);
+        std::string addr, type, name;
+
+        if (!(parts >> addr >> type >> name)) {
+          continue;
+        }
+
+        std::uint64_t addr_value = std::strtoull(addr.c_str(), nullptr, 16);
+
+        // Addresses are all zeros if kernel.kptr_restrict
+        // prevents reading them.
+        if (addr_value != 0 && (type == "t" || type == "T" ||
+                                type == "w" || type == "W")) {
+          this->kernel_symbols[addr_value] = name;
+        }
+      }
+    }
+
+    auto it = this->kernel_symbols.upper_bound(ip);
+
+    if (it == this->kernel_symbols.begin()) {
+      return nullptr;
+    }
+
+    return &std::prev(it)->second;
+  }
+
+  /**
+     Symbolizes an instruction address of a given process, following
+     the same rules as process_callchain_elem() in event-handler.py.
+
+     The returned reference is valid until the next call to any
+     non-const method of Symbolizer.
+  */
+  const Frame &Symbolizer::symbolize(std::int32_t pid, std::uint64_t ip) {
+    std::unordered_map<std::uint64_t, Frame> &pid_cache = this->cache[pid];
+    auto cached = pid_cache.find(ip);
+
+    if (cached != pid_cache.end()) {
+      return cached->second;
+    }
+
+    Frame frame;
+    frame.symbol = "[" + to_hex(ip) + "]";
+    frame.offset = ip;
+    frame.dso_offset = false;
+
+    bool cacheable = true;
+    Mapping *mapping = nullptr;
+    auto pid_mappings = this->mappings.find(pid);
+
+    if (pid_mappings != this->mappings.end()) {
+      auto it = pid_mappings->second.upper_bound(ip);
+
+      if (it != pid_mappings->second.begin()) {
+        it--;
+
+        if (ip < it->second.start + it->second.len) {
+          mapping = &it->second;
+        }
+      }
+    }
+
+    if (!mapping && (ip >> 63) != 0) {
+      frame.dso = "[kernel.kallsyms]";
+      const std::string *symbol = this->find_kernel_symbol(ip);
+      frame.symbol = symbol ? *symbol : "[" + frame.dso + "]";
+    } else if (mapping) {
+      frame.dso = mapping->filename;
+
+      if (frame.dso.starts_with("/tmp/perf-") && frame.dso.ends_with(".map")) {
+        const std::string *symbol = this->get_perf_map(frame.dso)->find_symbol(ip);
+
+        if (symbol) {
+          frame.symbol = *symbol;
+        } else {
+          // The symbol may still appear in the map later.
+          frame.symbol = "[" + frame.dso + "]";
+          cacheable = false;
+        }
+      } else {
+        ElfFile *elf_file = this->get_elf_file(frame.dso);
+        std::uint64_t file_offset = ip - mapping->start + mapping->pgoff;
+
+        frame.offset = elf_file ? elf_file->file_offset_to_address(file_offset) : file_offset;
+        frame.dso_offset = true;
+
+        const std::string *symbol = elf_file ? elf_file->find_symbol(frame.offset) : nullptr;
+        frame.symbol = symbol ? *symbol : "[" + frame.dso + "]";
+      }
+    }
+
+    if (!cacheable) {
+      this->uncached_frame = frame;
+      return this->uncached_frame;
+    }
+
+    return pid_cache.insert({ip, frame}).first->second;
+  }
+
+  /**
+     Gets the paths of all "perf" symbol maps which have been
+     expected, but not found.
+  */
+  std::vector<fs::path> Symbolizer::get_missing_perf_maps() {
+    std::vector<fs::path> result;
+
+    for (auto &entry : this->perf_maps) {
+      if (!entry.second->is_found()) {
+        result.push_back(entry.first);
+      }
+    }
+
+    return result;
+  }
+
+  /**
+     Constructs a PerfDataReader object and opens a stream for reading.
+
+     The stream is opened in non-blocking mode so that the constructor
+     returns immediately if the stream is a named pipe without any
+     writer yet. In this case, the reader should be constructed before
+     the writer is started, so that the latter does not block when
+     opening the pipe.
+
+     @param path        The path to a file or a named pipe with the output
+                        of "perf record -o -".
+     @param event_types The event types to be assigned to sampling events
+                        (other than off-CPU and dummy ones) in the order
+                        in which they have been passed to "perf record".
+                        The names should match these produced by
+                        event-handler.py.
+     @param max_stack   The maximum number of callchain elements to be
+                        kept per sample.
+
+     @throw std::runtime_error When the stream cannot be opened.
+  */
+  PerfDataReader::PerfDataReader(fs::path path,
+                                 std::vector<std::string> event_types,
+                                 unsigned int max_stack) {
+    this->path = path;
+    this->fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (this->fd == -1) {
+      throw std::runtime_error("Could not open " + path.string());
+    }
+
+    this->buf.resize(MIN_PERF_DATA_BUFFER_SIZE);
+    this->begin = 0;
+    this->end = 0;
+    this->header_read = false;
+    this->event_types = event_types;
+    this->next_event_type = 0;
+    this->max_stack = max_stack;
+  }
+
+  PerfDataReader::~PerfDataReader() {
+    close(this->fd);
+  }
+
+  /**
+     Gets the Symbolizer object kept up-to-date by the reader.
+  */
+  Symbolizer &PerfDataReader::get_symbolizer() {
+    return this->symbolizer;
+  }
+
+  /**
+     Gets the lost samples and throttling events counted so far,
+     one entry per thread and event type.
+  */
+  std::vector<PerfLoss> PerfDataReader::get_losses() {
+    std::vector<PerfLoss> result;
+
+    for (auto &entry : this->losses) {
+      result.push_back(entry.second);
+    }
+
+    return result;
+  }
+
+  /**
+     Makes sure that at least a given number of bytes is available
+     in the internal buffer starting from this->begin.
+
+     Returns false if the stream ends before that.
+  */
+  bool PerfDataReader::fill(std::size_t size) {
+    if (this->begin + size > this->buf.size()) {
+      std::memmove(this->buf.data(), this->buf.data() + this->begin,
+                   this->end - this->begin);
+      this->end -= this->begin;
+      this->begin = 0;
+
+      if (size > this->buf.size()) {
+        this->buf.resize(size);
+      }
+    }
+
+    while (this->end - this->begin < size) {
+      // poll() does not report a hang-up of a named pipe until
+      // a writer has connected and disconnected, so this waits for
+      // "perf record" to open the pipe as well.
+      pollfd poll_fd = {this->fd, POLLIN, 0};
+
+      if (poll(&poll_fd, 1, -1) == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        return false;
+      }
+
+      ssize_t bytes = ::read(this->fd, this->buf.data() + this->end,
+                             this->buf.size() - this->end);
+
+      if (bytes == -1 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+
+      if (bytes <= 0) {
+        return false;
+      }
+
+      this->end += bytes;
+    }
+
+    return true;
+  }
+
+  /**
+     Skips a given number of bytes of the stream.
+  */
+  void PerfDataReader::skip(std::uint64_t size) {
+    while (size > 0) {
+      std::size_t chunk = std::min<std::uint64_t>(size, this->buf.size());
+
+      if (!this->fill(chunk)) {
+        return;
+      }
+
+      this->begin += chunk;
+      size -= chunk;
+    }
+  }
+
+  void PerfDataReader::process_attr(std::string_view payload) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+
+    if (payload.size() < PERF_ATTR_SIZE_VER0) {
+      return;
+    }
+
+    std::uint32_t attr_size;
+    std::memcpy(&attr_size, payload.data() + offsetof(perf_event_attr, size),
+                sizeof(attr_size));
+
+    if (attr_size == 0) {
+      attr_size = PERF_ATTR_SIZE_VER0;
+    }
+
+    std::memcpy(&attr, payload.data(),
+                std::min<std::size_t>({attr_size, sizeof(attr), payload.size()}));
+
+    Attr result;
+    result.type = attr.type;
+    result.config = attr.config;
+    result.sample_type = attr.sample_type;
+    result.sample_period = attr.freq ? 0 : attr.sample_period;
+    result.read_format = attr.read_format;
+    result.sample_id_all = attr.sample_id_all;
+
+    if (attr.type == PERF_TYPE_SOFTWARE && attr.config == PERF_COUNT_SW_BPF_OUTPUT) {
+      result.event_type = "offcpu-time";
+    } else if (attr.type == PERF_TYPE_SOFTWARE && attr.config == PERF_COUNT_SW_DUMMY) {
+      result.event_type = "";
+    } else if (this->next_event_type < this->event_types.size()) {
+      result.event_type = this->event_types[this->next_event_type++];
+    } else {
+      result.event_type = "";
+    }
+
+    this->attrs.push_back(result);
+
+    for (std::size_t pos = attr_size; pos + sizeof(std::uint64_t) <= payload.size();
+         pos += sizeof(std::uint64_t)) {
+      std::uint64_t id;
+      std::memcpy(&id, payload.data() + pos, sizeof(id));
+      this->id_to_attr[id] = this->attrs.size() - 1;
+    }
+  }
+
+  PerfDataReader::Attr *PerfDataReader::find_sample_attr(std::string_view payload) {
+    if (this->attrs.empty()) {
+      return nullptr;
+    } else if (this->attrs.size() == 1) {
+      return &this->attrs[0];
+    }
+
+    // "perf" makes sure that the position of an event ID is the same
+    // for all events when more than one event is recorded.
+    std::uint64_t sample_type = this->attrs[0].sample_type;
+    std::size_t id_pos;
+
+    if (sample_type & PERF_SAMPLE_IDENTIFIER) {
+      id_pos = 0;
+    } else if (sample_type & PERF_SAMPLE_ID) {
+      id_pos = 0;
+
+      for (std::uint64_t flag : {PERF_SAMPLE_IP, PERF_SAMPLE_TID,
+                                 PERF_SAMPLE_TIME, PERF_SAMPLE_ADDR}) {
+        if (sample_type & flag) {
+          id_pos += sizeof(std::uint64_t);
+        }
+      }
+    } else {
+      return &this->attrs[0];
+    }
+
+    if (id_pos + sizeof(std::uint64_t) > payload.size()) {
+      return nullptr;
+    }
+
+    std::uint64_t id;
+    std::memcpy(&id, payload.data() + id_pos, sizeof(id));
+
+    auto it = this->id_to_attr.find(id);
+    return it == this->id_to_attr.end() ? nullptr : &this->attrs[it->second];
+  }
+
+  /**
+     Counts lost samples or throttling events reported by a non-sample
+     record. The thread (and the event if attr is null) is read from
+     the sample_id trailer of the record, if "perf record" has
+     requested it (sample_id_all).
+  */
+  void PerfDataReader::add_loss(std::string_view payload, Attr *attr,
+                                std::uint64_t lost, std::uint64_t throttles) {
+    std::int32_t pid = -1;
+    std::int32_t tid = -1;
+
+    if (!this->attrs.empty()) {
+      // The layout of the trailer depends on the event, which can
+      // be told only by the identifier at its end if there is more
+      // than one event.
+      Attr *layout = &this->attrs[0];
+
+      if (this->attrs.size() > 1 && (layout->sample_type & PERF_SAMPLE_IDENTIFIER) &&
+          payload.size() >= sizeof(std::uint64_t)) {
+        std::uint64_t id;
+        std::memcpy(&id, payload.data() + payload.size() - sizeof(id), sizeof(id));
+        auto it = this->id_to_attr.find(id);
+        layout = it == this->id_to_attr.end() ? nullptr : &this->attrs[it->second];
+
+        if (!attr) {
+          attr = layout;
+        }
+      } else if (!attr && this->attrs.size() == 1) {
+        attr = layout;
+      }
+
+      if (layout && layout->sample_id_all && (layout->sample_type & PERF_SAMPLE_TID)) {
+        std::size_t size = 0;
+
+        for (std::uint64_t flag : {PERF_SAMPLE_TID, PERF_SAMPLE_TIME, PERF_SAMPLE_ID,
+                                   PERF_SAMPLE_STREAM_ID, PERF_SAMPLE_CPU,
+                                   PERF_SAMPLE_IDENTIFIER}) {
+          if (layout->sample_type & flag) {
+            size += sizeof(std::uint64_t);
+          }
+        }
+
+        if (size <= payload.size()) {
+          std::memcpy(&pid, payload.data() + payload.size() - size, sizeof(pid));
+          std::memcpy(&tid, payload.data() + payload.size() - size + sizeof(pid),
+                      sizeof(tid));
+        }
+      }
+    }
+
+    std::string event_type = attr ? attr->event_type : "";
+    PerfLoss &loss = this->losses.try_emplace({event_type, pid, tid},
+                                              PerfLoss{event_type, pid, tid, 0, 0}).first->second;
+    loss.lost += lost;
+    loss.throttles += throttles;
+  }
+
+  bool PerfDataReader::parse_sample(std::string_view payload, PerfSample &sample) {
+    Attr *attr = this->find_sample_attr(payload);
+
+    if (!attr || attr->event_type.empty()) {
+      return false;
+    }
+
+    std::uint64_t sample_type = attr->sample_type;
+    FrameParser parser(payload);
+
+    try {
+      std::uint64_t ip = 0;
+
+      sample.event_type = attr->event_type;
+      sample.pid = -1;
+      sample.tid = -1;
+      sample.time = 0;
+      sample.period = attr->sample_period;
+      sample.callchain.clear();
+      sample.group_values.clear();
+
+      if (sample_type & PERF_SAMPLE_IDENTIFIER) {
+        parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_IP) {
+        ip = parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_TID) {
+        sample.pid = parser.get<std::int32_t>();
+        sample.tid = parser.get<std::int32_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_TIME) {
+        sample.time = parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_ADDR) {
+        parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_ID) {
+        parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_STREAM_ID) {
+        parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_CPU) {
+        parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_PERIOD) {
+        sample.period = parser.get<std::uint64_t>();
+      }
+
+      if (sample_type & PERF_SAMPLE_READ) {
+        std::uint64_t read_format = attr->read_format;
+        std::uint64_t nr = 1;
+
+        if (read_format & PERF_FORMAT_GROUP) {
+          nr = parser.get<std::uint64_t>();
+        } else {
+          parser.get<std::uint64_t>();
+        }
+
+        if (read_format & PERF_FORMAT_TOTAL_TIME_ENABLED) {
+          parser.get<std::uint64_t>();
+        }
+
+        if (read_format & PERF_FORMAT_TOTAL_TIME_RUNNING) {
+          parser.get<std::uint64_t>();
+        }
+
+        for (std::uint64_t i = 0; i < nr; i++) {
+          std::uint64_t value = 0;
+
+          if (read_format & PERF_FORMAT_GROUP) {
+            value = parser.get<std::uint64_t>();
+          }
+
+          // Values are cumulative, so they are turned into deltas
+          // in the same way as perf-script does.
+          if (read_format & PERF_FORMAT_ID) {
+            std::uint64_t id = parser.get<std::uint64_t>();
+            auto member = this->id_to_attr.find(id);
+
+            if ((read_format & PERF_FORMAT_GROUP) &&
+                member != this->id_to_attr.end() &&
+                &this->attrs[member->second] != attr &&
+                !this->attrs[member->second].event_type.empty()) {
+              std::uint64_t &last_value = this->read_values[id];
+
+              if (value > last_value) {
+                sample.group_values.push_back(
+                  std::make_pair(this->attrs[member->second].event_type,
+                                 value - last_value));
+              }
+
+              last_value = value;
+            }
+          }
+
+          if (read_format & PERF_FORMAT_LOST) {
+            parser.get<std::uint64_t>();
+          }
+        }
+      }
+
+      if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+        std::uint64_t nr = parser.get<std::uint64_t>();
+
+        for (std::uint64_t i = 0; i < nr; i++) {
+          std::uint64_t callchain_ip = parser.get<std::uint64_t>();
+
+          if (callchain_ip >= PERF_CONTEXT_MAX) {
+            continue;
+          }
+
+          if (sample.callchain.size() < this->max_stack) {
+            sample.callchain.push_back(callchain_ip);
+          }
+        }
+      } else if (sample_type & PERF_SAMPLE_IP) {
+        sample.callchain.push_back(ip);
+      }
+    } catch (std::out_of_range &) {
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+     Reads the stream until the next sample is decoded.
+
+     Returns false if the end of the stream has been reached.
+
+     @throw std::runtime_error When the stream is not a pipe-mode
+                               "perf record" output or is corrupted.
+  */
+  bool PerfDataReader::read(PerfSample &sample) {
+    if (!this->header_read) {
+      this->header_read = true;
+
+      if (!this->fill(2 * sizeof(std::uint64_t))) {
+        return false;
+      }
+
+      std::uint64_t magic, header_size;
+      std::memcpy(&magic, this->buf.data() + this->begin, sizeof(magic));
+      std::memcpy(&header_size, this->buf.data() + this->begin + sizeof(magic),
+                  sizeof(header_size));
+
+      if (magic != PERF_PIPE_MAGIC) {
+        throw std::runtime_error(this->path.string() + " is not a pipe-mode \"perf record\" "
+                                 "output");
+      }
+
+      this->skip(header_size);
+    }
+
+    while (true) {
+      if (!this->fill(sizeof(perf_event_header))) {
+        return false;
+      }
+
+      perf_event_header header;
+      std::memcpy(&header, this->buf.data() + this->begin, sizeof(header));
+
+      if (header.size < sizeof(header)) {
+        throw std::runtime_error("A corrupted record has been found in " +
+                                 this->path.string());
+      }
+
+      if (!this->fill(header.size)) {
+        return false;
+      }
+
+      std::string_view payload(this->buf.data() + this->begin + sizeof(header),
+                               header.size - sizeof(header));
+      this->begin += header.size;
+
+      FrameParser parser(payload);
+
+      try {
+        switch (header.type) {
+        case PERF_RECORD_SAMPLE:
+          if (this->parse_sample(payload, sample)) {
+            return true;
+          }
+          break;
+
+        case PERF_RECORD_MMAP: {
+          std::int32_t pid = parser.get<std::int32_t>();
+          parser.get<std::int32_t>();
+          std::uint64_t addr = parser.get<std::uint64_t>();
+          std::uint64_t len = parser.get<std::uint64_t>();
+          std::uint64_t pgoff = parser.get<std::uint64_t>();
+          std::string_view filename = parser.get_rest();
+
+          this->symbolizer.add_mapping(pid, addr, len, pgoff,
+                                       std::string(filename.substr(0, filename.find('\0'))));
+          break;
+        }
+
+        case PERF_RECORD_MMAP2: {
+          std::int32_t pid = parser.get<std::int32_t>();
+          parser.get<std::int32_t>();
+          std::uint64_t addr = parser.get<std::uint64_t>();
+          std::uint64_t len = parser.get<std::uint64_t>();
+          std::uint64_t pgoff = parser.get<std::uint64_t>();
+          parser.get_string(24); // Device/inode or build ID
+          std::uint32_t prot = parser.get<std::uint32_t>();
+          parser.get<std::uint32_t>();
+          std::string_view filename = parser.get_rest();
+
+          if (prot & PROT_EXEC) {
+            this->symbolizer.add_mapping(pid, addr, len, pgoff,
+                                         std::string(filename.substr(0, filename.find('\0'))));
+          }
+          break;
+        }
+
+        case PERF_RECORD_COMM:
+          if (header.misc & PERF_RECORD_MISC_COMM_EXEC) {
+            this->symbolizer.exec(parser.get<std::int32_t>());
+          }
+          break;
+
+        case PERF_RECORD_FORK: {
+          std::int32_t pid = parser.get<std::int32_t>();
+          std::int32_t ppid = parser.get<std::int32_t>();
+          this->symbolizer.fork(ppid, pid);
+          break;
+        }
+
+        case PERF_RECORD_EXIT:
+          // Mappings are kept because samples of exiting processes
+          // may still follow.
+          break;
+
+        case PERF_RECORD_LOST: {
+          auto attr = this->id_to_attr.find(parser.get<std::uint64_t>());
+          std::uint64_t lost = parser.get<std::uint64_t>();
+          this->add_loss(payload, attr == this->id_to_attr.end() ?
+                         nullptr : &this->attrs[attr->second], lost, 0);
+          break;
+        }
+
+        case PERF_RECORD_LOST_SAMPLES:
+          this->add_loss(payload, nullptr, parser.get<std::uint64_t>(), 0);
+          break;
+
+        // Only the start of throttling is counted, there is nothing
+        // to be done at its end (PERF_RECORD_UNTHROTTLE).
+        case PERF_RECORD_THROTTLE: {
+          parser.get<std::uint64_t>();
+          auto attr = this->id_to_attr.find(parser.get<std::uint64_t>());
+          this->add_loss(payload, attr == this->id_to_attr.end() ?
+                         nullptr : &this->attrs[attr->second], 0, 1);
+          break;
+        }
+
+        case USER_RECORD_HEADER_ATTR:
+          this->process_attr(payload);
+          break;
+
+        case USER_RECORD_HEADER_TRACING_DATA:
+          this->skip(parser.get<std::uint32_t>());
+          break;
+
+        case USER_RECORD_AUXTRACE:
+          this->skip(parser.get<std::uint64_t>());
+          break;
+
+        case USER_RECORD_COMPRESSED:
+          throw std::runtime_error("Compressed \"perf record\" output is not supported");
+        }
+      } catch (std::out_of_range &) {
+        // Truncated records are ignored.
+      }
+    }
+  }
+};
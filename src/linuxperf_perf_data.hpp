@@ -0,0 +1,230 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef LINUXPERF_PERF_DATA_HPP_
+#define LINUXPERF_PERF_DATA_HPP_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <filesystem>
+#include <cstdint>
+#include <linux/perf_event.h>
+
+namespace adaptyst {
+  namespace fs = std::filesystem;
+
+  /**
+     A class describing function symbols of an ELF file (an executable
+     or a shared library).
+  */
+  class ElfFile {
+  private:
+    struct Symbol {
+      std::uint64_t addr;
+      std::uint64_t size;
+      std::uint32_t name;
+    };
+
+    struct Segment {
+      std::uint64_t offset;
+      std::uint64_t vaddr;
+      std::uint64_t size;
+    };
+
+    std::vector<Symbol> symbols;
+    std::vector<Segment> segments;
+    std::string strtab;
+    std::unordered_map<std::uint32_t, std::string> demangled;
+    bool valid;
+
+  public:
+    ElfFile(fs::path path);
+    bool is_valid();
+    std::uint64_t file_offset_to_address(std::uint64_t offset);
+    const std::string *find_symbol(std::uint64_t addr);
+  };
+
+  /**
+     A class describing a "perf" symbol map (/tmp/perf-<PID>.map)
+     emitted by JIT-compiling runtimes.
+  */
+  class PerfMap {
+  private:
+    struct Entry {
+      std::uint64_t start;
+      std::uint64_t size;
+      std::string name;
+      bool demangled;
+    };
+
+    fs::path path;
+    std::vector<Entry> entries;
+    std::uintmax_t loaded_size;
+    bool exists;
+
+    bool load();
+
+  public:
+    PerfMap(fs::path path);
+    bool is_found();
+    const std::string *find_symbol(std::uint64_t ip);
+  };
+
+  /**
+     A class describing a symbolized callchain element.
+
+     symbol and dso follow the same conventions as the symbol
+     tuples produced by event-handler.py. offset is either
+     an address within dso (if dso_offset is true, i.e. dso is
+     a file which can be used for resolving source code lines)
+     or an instruction address otherwise.
+  */
+  class Frame {
+  public:
+    std::string symbol;
+    std::string dso;
+    std::uint64_t offset;
+    bool dso_offset;
+  };
+
+  /**
+     A class translating instruction addresses of profiled processes
+     into symbol names, based on memory mappings reported by "perf".
+  */
+  class Symbolizer {
+  private:
+    struct Mapping {
+      std::uint64_t start;
+      std::uint64_t len;
+      std::uint64_t pgoff;
+      std::string filename;
+    };
+
+    std::unordered_map<std::int32_t, std::map<std::uint64_t, Mapping> > mappings;
+    std::unordered_map<std::int32_t, std::unordered_map<std::uint64_t, Frame> > cache;
+    std::unordered_map<std::string, std::unique_ptr<ElfFile> > elf_files;
+    std::unordered_map<std::string, std::unique_ptr<PerfMap> > perf_maps;
+    std::map<std::uint64_t, std::string> kernel_symbols;
+    bool kernel_symbols_loaded;
+    Frame uncached_frame;
+
+    ElfFile *get_elf_file(const std::string &filename);
+    PerfMap *get_perf_map(const std::string &filename);
+    const std::string *find_kernel_symbol(std::uint64_t ip);
+
+  public:
+    Symbolizer();
+    void add_mapping(std::int32_t pid, std::uint64_t start,
+                     std::uint64_t len, std::uint64_t pgoff,
+                     std::string filename);
+    void fork(std::int32_t parent_pid, std::int32_t child_pid);
+    void exec(std::int32_t pid);
+    const Frame &symbolize(std::int32_t pid, std::uint64_t ip);
+    std::vector<fs::path> get_missing_perf_maps();
+  };
+
+  /**
+     A class describing a sample decoded from a "perf record" stream.
+
+     callchain is ordered from the innermost frame (i.e. the sampled
+     instruction) to the outermost one, with all context markers
+     removed.
+
+     If the sampled event is the leader of an event group read
+     on every sample, group_values contains the event types of
+     the other events in the group along with the increases of their
+     values since the previous sample of the same event (zero
+     increases are omitted).
+  */
+  class PerfSample {
+  public:
+    std::string event_type;
+    std::int32_t pid;
+    std::int32_t tid;
+    std::uint64_t time;
+    std::uint64_t period;
+    std::vector<std::uint64_t> callchain;
+    std::vector<std::pair<std::string, std::uint64_t> > group_values;
+  };
+
+  /**
+     A class describing samples of a thread and an event type which
+     haven't made it to the output of "perf record". pid and tid are
+     -1 if the thread is unknown and event_type is empty if the event
+     type is unknown.
+
+     lost is the number of samples lost because of full buffers and
+     throttles is the number of times the kernel has throttled
+     sampling because of too high a sample rate.
+  */
+  class PerfLoss {
+  public:
+    std::string event_type;
+    std::int32_t pid;
+    std::int32_t tid;
+    std::uint64_t lost;
+    std::uint64_t throttles;
+  };
+
+  /**
+     A class decoding the pipe-mode output of "perf record -o -"
+     without involving perf-script.
+
+     Memory mapping, COMM, FORK and EXIT records are consumed
+     internally to keep the Symbolizer object of the reader up-to-date
+     and only samples are returned to the caller. LOST, LOST_SAMPLES
+     and THROTTLE records are counted and available through
+     get_losses().
+  */
+  class PerfDataReader {
+  private:
+    struct Attr {
+      std::uint32_t type;
+      std::uint64_t config;
+      std::uint64_t sample_type;
+      std::uint64_t sample_period;
+      std::uint64_t read_format;
+      bool sample_id_all;
+      std::string event_type;
+    };
+
+    fs::path path;
+    int fd;
+    std::vector<char> buf;
+    std::size_t begin;
+    std::size_t end;
+    bool header_read;
+    std::vector<Attr> attrs;
+    std::unordered_map<std::uint64_t, std::size_t> id_to_attr;
+    std::unordered_map<std::uint64_t, std::uint64_t> read_values;
+    std::vector<std::string> event_types;
+    std::size_t next_event_type;
+    unsigned int max_stack;
+    Symbolizer symbolizer;
+    std::map<std::tuple<std::string, std::int32_t, std::int32_t>, PerfLoss> losses;
+
+    bool fill(std::size_t size);
+    void skip(std::uint64_t size);
+    void process_attr(std::string_view payload);
+    Attr *find_sample_attr(std::string_view payload);
+    bool parse_sample(std::string_view payload, PerfSample &sample);
+    void add_loss(std::string_view payload, Attr *attr,
+                  std::uint64_t lost, std::uint64_t throttles);
+
+  public:
+    PerfDataReader(fs::path path,
+                   std::vector<std::string> event_types,
+                   unsigned int max_stack);
+    ~PerfDataReader();
+    bool read(PerfSample &sample);
+    Symbolizer &get_symbolizer();
+    std::vector<PerfLoss> get_losses();
+  };
+};
+
+#endif
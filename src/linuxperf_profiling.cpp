@@ -6,6 +6,11 @@
 #include <fstream>
 #include <boost/algorithm/string.hpp>
 #include <nlohmann/json.hpp>
+#include <atomic>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
 
 #ifdef BOOST_OS_UNIX
 #include <sys/wait.h>
@@ -17,6 +22,9 @@
 
 #define ACCEPT_TIMEOUT 5
 
+// In milliseconds
+#define CONTROL_ACK_TIMEOUT 5000
+
 namespace adaptyst {
   namespace ch = std::chrono;
   using namespace std::chrono_literals;
@@ -226,16 +234,27 @@ namespace adaptyst {
                                   them for processing. 0 leaves
                                   the default adaptive buffering, 1
                                   effectively disables buffering.
+     @param group_events          The PerfEvent objects corresponding
+                                  to custom "perf" events to be read
+                                  in a group together with on-CPU
+                                  samples rather than sampled
+                                  separately. Their periods are
+                                  ignored. Each on-CPU sample then
+                                  carries the increase of every
+                                  event since the previous sample
+                                  in the same thread.
   */
   PerfEvent::PerfEvent(int freq,
                        int off_cpu_freq,
                        int buffer_events,
-                       int buffer_off_cpu_events) {
+                       int buffer_off_cpu_events,
+                       std::vector<PerfEvent> group_events) {
     this->name = "<main>";
     this->options.push_back(std::to_string(freq));
     this->options.push_back(std::to_string(off_cpu_freq));
     this->options.push_back(std::to_string(buffer_events));
     this->options.push_back(std::to_string(buffer_off_cpu_events));
+    this->events = group_events;
   }
 
   /**
@@ -265,6 +284,30 @@ namespace adaptyst {
     this->unit = unit;
   }
 
+  /**
+     Constructs a PerfEvent object corresponding to multiple custom
+     Linux "perf" events sampled by a single "perf" instance.
+
+     Samples of all events are sent through the same pipeline and
+     must be told apart by their event types (see get_type()), so
+     the event types of the events should be unique.
+
+     @param events The PerfEvent objects corresponding to custom
+                   "perf" events. They must not be empty.
+  */
+  PerfEvent::PerfEvent(std::vector<PerfEvent> &events) {
+    this->name = "<multi>";
+    this->events = events;
+
+    int buffer_events = std::stoi(events[0].options[1]);
+
+    for (auto &event : events) {
+      buffer_events = std::min(buffer_events, std::stoi(event.options[1]));
+    }
+
+    this->options.push_back(std::to_string(buffer_events));
+  }
+
   /**
      Gets the name of a "perf" event as displayed by "perf list".
   */
@@ -272,6 +315,15 @@ namespace adaptyst {
     return this->name;
   }
 
+  /**
+     Gets the type of a "perf" event as reported in its samples,
+     i.e. its name without any "/..." modifiers. This matches
+     the event type parsing in event-handler.py.
+  */
+  std::string PerfEvent::get_type() {
+    return this->name.substr(0, this->name.find('/'));
+  }
+
   /**
      Gets the human-friendly title of a "perf" event.
   */
@@ -301,6 +353,15 @@ namespace adaptyst {
      @param cpu_config       A CPUConfig object describing how CPU cores should
                              be used for profiling.
      @param name             The name of this "perf" instance.
+     @param capture_mode     The stack trace types to be captured.
+     @param filter           The stack trace filtering settings.
+     @param wire_format      The format of messages to be sent by
+                             the "perf" script through non-generic
+                             connections. It is negotiated with the
+                             script when start() is called. If RAW,
+                             perf-script is not run at all and the
+                             "perf record" output is decoded by
+                             the reader returned by get_raw_reader().
   */
   Perf::Perf(Acceptor::Factory &acceptor_factory,
              unsigned int buf_size,
@@ -311,7 +372,8 @@ namespace adaptyst {
              CPUConfig &cpu_config,
              std::string name,
              CaptureMode capture_mode,
-             Filter filter) : Profiler(acceptor_factory, buf_size),
+             Filter filter,
+             WireFormat wire_format) : Profiler(acceptor_factory, buf_size),
                                           cpu_config(cpu_config) {
     this->perf_bin_path = perf_bin_path;
     this->perf_python_path = perf_python_path;
@@ -321,6 +383,9 @@ namespace adaptyst {
     this->max_stack = 1024;
     this->capture_mode = capture_mode;
     this->filter = filter;
+    this->wire_format = wire_format;
+    this->control_fd = -1;
+    this->ack_fd = -1;
 
     this->requirements.push_back(std::make_unique<PerfEventKernelSettingsReq>(this->max_stack));
     this->requirements.push_back(std::make_unique<NUMAMitigationReq>());
@@ -330,6 +395,14 @@ namespace adaptyst {
     return this->name;
   }
 
+  /**
+     Makes "perf record" attach to already running processes
+     instead of the profiled command. Must be called before start().
+  */
+  void Perf::set_target(Target target) {
+    this->target = target;
+  }
+
   void Perf::start(pid_t pid,
                    bool capture_immediately) {
     const char *log_dir = adaptyst_get_log_dir(module_id);
@@ -351,7 +424,7 @@ namespace adaptyst {
         "CLOCK_MONOTONIC", "--buffer-events", "1", "-e",
         "syscalls:sys_exit_execve,syscalls:sys_exit_execveat,"
         "sched:sched_process_fork,sched:sched_process_exit",
-        "--sorted-stream", "--pid=" + std::to_string(pid)};
+        "--sorted-stream"};
       argv_script = {this->perf_bin_path.string(), "script", "-i", "-", "-s",
         this->perf_script_path.string() + "/event-handler.py",
         "--demangle", "--demangle-kernel",
@@ -361,14 +434,49 @@ namespace adaptyst {
       stderr_record /= "perf_record_main_stderr.log";
       stderr_script /= "perf_script_main_stderr.log";
 
+      // With group events, only task-clock is sampled (":S") and
+      // the values of all events in the group are read on every
+      // sample.
+      std::string main_event = "task-clock";
+
+      if (!this->perf_event.events.empty()) {
+        main_event = "{task-clock";
+
+        for (auto &event : this->perf_event.events) {
+          main_event += "," + event.name;
+        }
+
+        main_event += "}:S";
+      }
+
       argv_record = {this->perf_bin_path.string(), "record", "-o", "-",
         "--call-graph", "fp", "-k",
         "CLOCK_MONOTONIC", "--sorted-stream", "-e",
-        "task-clock", "-F", this->perf_event.options[0],
+        main_event, "-F", this->perf_event.options[0],
         "--off-cpu", this->perf_event.options[1],
         "--buffer-events", this->perf_event.options[2],
-        "--buffer-off-cpu-events", this->perf_event.options[3],
-        "--pid=" + std::to_string(pid)};
+        "--buffer-off-cpu-events", this->perf_event.options[3]};
+      argv_script = {this->perf_bin_path.string(), "script", "-i", "-", "-s",
+        this->perf_script_path.string() + "/event-handler.py",
+        "--demangle", "--demangle-kernel",
+        "--max-stack=" + std::to_string(this->max_stack)};
+    } else if (this->perf_event.name == "<multi>") {
+      stdout /= "perf_script_multi_stdout.log";
+      stderr_record /= "perf_record_multi_stderr.log";
+      stderr_script /= "perf_script_multi_stderr.log";
+
+      argv_record = {this->perf_bin_path.string(), "record", "-o", "-",
+        "--call-graph", "fp", "-k",
+        "CLOCK_MONOTONIC", "--sorted-stream"};
+
+      for (auto &event : this->perf_event.events) {
+        argv_record.push_back("-e");
+        argv_record.push_back(event.name + "/period=" + event.options[0] + "/");
+      }
+
+      argv_record.push_back("--buffer-events");
+      argv_record.push_back(this->perf_event.options[0]);
+
       argv_script = {this->perf_bin_path.string(), "script", "-i", "-", "-s",
         this->perf_script_path.string() + "/event-handler.py",
         "--demangle", "--demangle-kernel",
@@ -382,14 +490,30 @@ namespace adaptyst {
         "--call-graph", "fp", "-k",
         "CLOCK_MONOTONIC", "--sorted-stream", "-e",
         this->perf_event.name + "/period=" + this->perf_event.options[0] + "/",
-        "--buffer-events", this->perf_event.options[1],
-        "--pid=" + std::to_string(pid)};
+        "--buffer-events", this->perf_event.options[1]};
       argv_script = {this->perf_bin_path.string(), "script", "-i", "-", "-s",
         this->perf_script_path.string() + "/event-handler.py",
         "--demangle", "--demangle-kernel",
         "--max-stack=" + std::to_string(this->max_stack)};
     }
 
+    if (!this->target.cgroup.empty()) {
+      // "-G" must follow all events it applies to.
+      argv_record.push_back("-a");
+      argv_record.push_back("-G");
+      argv_record.push_back(this->target.cgroup);
+    } else if (!this->target.pids.empty()) {
+      std::string pids;
+
+      for (pid_t target_pid : this->target.pids) {
+        pids += (pids.empty() ? "" : ",") + std::to_string(target_pid);
+      }
+
+      argv_record.push_back("--pid=" + pids);
+    } else {
+      argv_record.push_back("--pid=" + std::to_string(pid));
+    }
+
     if (this->capture_mode == KERNEL) {
       argv_record.push_back("--kernel-callchains");
     } else if (this->capture_mode == USER) {
@@ -399,41 +523,113 @@ namespace adaptyst {
       argv_record.push_back("--user-callchains");
     }
 
-    this->record_proc = std::make_unique<Process>(argv_record);
-    this->record_proc->set_redirect_stderr(stderr_record);
+    static std::atomic<unsigned int> control_index = 0;
+    unsigned int index = control_index++;
 
-    this->script_proc = std::make_unique<Process>(argv_script);
+    fs::path tmp_dir(adaptyst_get_tmp_dir(module_id));
+    this->control_path = tmp_dir / ("perf_control_" + std::to_string(index) + ".fifo");
+    this->ack_path = tmp_dir / ("perf_control_" + std::to_string(index) + "_ack.fifo");
 
-    char *cur_pythonpath = getenv("PYTHONPATH");
+    if (mkfifo(this->control_path.c_str(), 0600) == -1 ||
+        mkfifo(this->ack_path.c_str(), 0600) == -1) {
+      throw std::runtime_error("Could not create named pipes for controlling "
+                               "profiler \"" + this->name + "\"");
+    }
 
-    if (cur_pythonpath) {
-      this->script_proc->add_env("PYTHONPATH",
-                                 this->perf_python_path.string() + ":" +
-                                 std::string(cur_pythonpath));
-    } else {
-      this->script_proc->add_env("PYTHONPATH",
-                                 this->perf_python_path.string());
+    // Opening a named pipe for both reading and writing never
+    // blocks, regardless of whether "perf record" has opened it.
+    this->control_fd = open(this->control_path.c_str(), O_RDWR | O_CLOEXEC);
+    this->ack_fd = open(this->ack_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (this->control_fd == -1 || this->ack_fd == -1) {
+      this->close_control();
+      throw std::runtime_error("Could not open named pipes for controlling "
+                               "profiler \"" + this->name + "\"");
     }
 
+    argv_record.push_back("--control=fifo:" + this->control_path.string() + "," +
+                          this->ack_path.string());
+
+    // The thread tree profiler is never paused as the tree would
+    // be incomplete otherwise.
+    if (!capture_immediately && this->perf_event.name != "<thread_tree>") {
+      argv_record.push_back("--delay=-1");
+    }
+
+    this->record_proc = std::make_unique<Process>(argv_record);
+    this->record_proc->set_redirect_stderr(stderr_record);
+
     unsigned int threads = this->get_thread_count();
     std::vector<std::unique_ptr<Acceptor> > acceptors;
-    std::stringstream instrs_stream;
 
-    for (int i = 0; i < threads; i++) {
-      acceptors.push_back(this->acceptor_factory.make_acceptor(1));
-      instrs_stream << " " << acceptors[i]->get_connection_instructions();
-    }
+    if (this->wire_format == RAW) {
+      static std::atomic<unsigned int> fifo_index = 0;
 
-    this->script_proc->add_env("ADAPTYST_CONNECT",
-                               acceptors[0]->get_type() +
-                               instrs_stream.str());
+      this->fifo_path = fs::path(adaptyst_get_tmp_dir(module_id)) /
+        ("perf_record_" + std::to_string(fifo_index++) + ".fifo");
 
-    this->script_proc->set_redirect_stdout(stdout);
-    this->script_proc->set_redirect_stderr(stderr_script);
+      if (mkfifo(this->fifo_path.c_str(), 0600) == -1) {
+        throw std::runtime_error("Could not create named pipe " +
+                                 this->fifo_path.string());
+      }
+
+      std::vector<std::string> event_types;
+
+      // Event types are assigned to events in the order of "-e"
+      // arguments, which is the order in which "perf record"
+      // writes their attributes.
+      if (this->perf_event.name == "<main>") {
+        event_types.push_back("task-clock");
+
+        for (auto &event : this->perf_event.events) {
+          event_types.push_back(event.get_type());
+        }
+      } else if (this->perf_event.name == "<multi>") {
+        for (auto &event : this->perf_event.events) {
+          event_types.push_back(event.get_type());
+        }
+      } else {
+        event_types.push_back(this->perf_event.get_type());
+      }
+
+      // The reader must open the pipe before "perf record" does, see
+      // the PerfDataReader constructor.
+      this->raw_reader = std::make_unique<PerfDataReader>(this->fifo_path,
+                                                          event_types,
+                                                          this->max_stack);
+      this->record_proc->set_redirect_stdout(this->fifo_path);
+    } else {
+      this->script_proc = std::make_unique<Process>(argv_script);
 
-    this->record_proc->set_redirect_stdout(*(this->script_proc));
+      char *cur_pythonpath = getenv("PYTHONPATH");
+
+      if (cur_pythonpath) {
+        this->script_proc->add_env("PYTHONPATH",
+                                   this->perf_python_path.string() + ":" +
+                                   std::string(cur_pythonpath));
+      } else {
+        this->script_proc->add_env("PYTHONPATH",
+                                   this->perf_python_path.string());
+      }
+
+      std::stringstream instrs_stream;
+
+      for (int i = 0; i < threads; i++) {
+        acceptors.push_back(this->acceptor_factory.make_acceptor(1));
+        instrs_stream << " " << acceptors[i]->get_connection_instructions();
+      }
+
+      this->script_proc->add_env("ADAPTYST_CONNECT",
+                                 acceptors[0]->get_type() +
+                                 instrs_stream.str());
+
+      this->script_proc->set_redirect_stdout(stdout);
+      this->script_proc->set_redirect_stderr(stderr_script);
+
+      this->record_proc->set_redirect_stdout(*(this->script_proc));
+      this->script_proc->start(false, this->cpu_config, true);
+    }
 
-    this->script_proc->start(false, this->cpu_config, true);
     this->record_proc->start(false, this->cpu_config, true);
 
     this->running = true;
@@ -442,6 +638,12 @@ namespace adaptyst {
       this->record_proc->close_stdin();
       int code = this->record_proc->join();
 
+      this->close_control();
+
+      if (this->wire_format == RAW) {
+        this->unblock_raw_reader();
+      }
+
       if (code != 0) {
         int status = waitpid(pid, nullptr, WNOHANG);
 
@@ -471,7 +673,10 @@ namespace adaptyst {
           break;
 
         case Process::ERROR_STDOUT_DUP2:
-          adaptyst_print(module_id, (hint + "redirecting stdout to perf-script.").c_str(), true, true, "General");
+          adaptyst_print(module_id, (hint + (this->wire_format == RAW ?
+                                             "redirecting stdout to named pipe." :
+                                             "redirecting stdout to perf-script.")).c_str(),
+                         true, true, "General");
           break;
 
         case Process::ERROR_STDERR_DUP2:
@@ -483,6 +688,11 @@ namespace adaptyst {
         return code;
       }
 
+      if (this->wire_format == RAW) {
+        this->running = false;
+        return code;
+      }
+
       code = this->script_proc->join();
 
       if (code != 0) {
@@ -532,6 +742,10 @@ namespace adaptyst {
       return code;
     });
 
+    if (this->wire_format == RAW) {
+      return;
+    }
+
     for (int i = 0; i < threads; i++) {
       while (true) {
         try {
@@ -571,23 +785,152 @@ namespace adaptyst {
       this->connections[0]->write(allowdenylist_json.dump());
     }
 
+    if (this->wire_format == BINARY) {
+      nlohmann::json wire_format_json = nlohmann::json::object();
+      wire_format_json["type"] = "wire_format";
+      wire_format_json["data"] = "binary";
+
+      this->connections[0]->write(wire_format_json.dump(), true);
+    }
+
     this->connections[0]->write("<STOP>", true);
   }
 
+  /**
+     Makes the raw reader stop waiting for "perf record" if the latter
+     has exited without opening the named pipe (e.g. because of
+     an error) and removes the pipe afterwards.
+  */
+  void Perf::unblock_raw_reader() {
+    int fd = open(this->fifo_path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd != -1) {
+      close(fd);
+    }
+
+    std::error_code error;
+    fs::remove(this->fifo_path, error);
+  }
+
   unsigned int Perf::get_thread_count() {
-    if (this->perf_event.name == "<thread_tree>") {
+    if (this->wire_format == RAW) {
+      return 1;
+    } else if (this->perf_event.name == "<thread_tree>") {
       return 2;
     } else {
       return this->cpu_config.get_profiler_thread_count() + 1;
     }
   }
 
+  /**
+     Sends a command to "perf record" through its control pipe and
+     waits for the acknowledgement. Returns whether the command has
+     been acknowledged.
+  */
+  bool Perf::send_control_command(std::string command) {
+    std::lock_guard<std::mutex> lock(this->control_mutex);
+
+    if (this->control_fd == -1) {
+      return false;
+    }
+
+    command += '\n';
+
+    if (write(this->control_fd, command.c_str(), command.size()) != (ssize_t)command.size()) {
+      return false;
+    }
+
+    std::string ack;
+    auto deadline = ch::steady_clock::now() + ch::milliseconds(CONTROL_ACK_TIMEOUT);
+
+    while (ack.find("ack\n") == std::string::npos) {
+      int timeout = ch::duration_cast<ch::milliseconds>(deadline -
+                                                        ch::steady_clock::now()).count();
+
+      if (timeout <= 0) {
+        return false;
+      }
+
+      struct pollfd fds = {this->ack_fd, POLLIN, 0};
+
+      if (poll(&fds, 1, timeout) <= 0) {
+        continue;
+      }
+
+      char buf[64];
+      int bytes = read(this->ack_fd, buf, sizeof(buf));
+
+      if (bytes > 0) {
+        ack.append(buf, bytes);
+      }
+    }
+
+    return true;
+  }
+
+  /**
+     Closes and removes the control pipes of "perf record".
+  */
+  void Perf::close_control() {
+    std::lock_guard<std::mutex> lock(this->control_mutex);
+
+    if (this->control_fd != -1) {
+      close(this->control_fd);
+      this->control_fd = -1;
+    }
+
+    if (this->ack_fd != -1) {
+      close(this->ack_fd);
+      this->ack_fd = -1;
+    }
+
+    std::error_code error;
+
+    if (!this->control_path.empty()) {
+      fs::remove(this->control_path, error);
+    }
+
+    if (!this->ack_path.empty()) {
+      fs::remove(this->ack_path, error);
+    }
+  }
+
+  /**
+     Resumes event capturing by enabling the events of "perf record"
+     through its control pipe. This has no effect on the thread tree
+     profiler, which always captures events.
+  */
   void Perf::resume() {
-    // TODO
+    if (this->perf_event.name != "<thread_tree>" &&
+        !this->send_control_command("enable")) {
+      adaptyst_print(module_id, ("Profiler \"" + this->name + "\" hasn't acknowledged "
+                                 "resuming event capturing.").c_str(), true, false, "General");
+    }
   }
 
+  /**
+     Pauses event capturing by disabling the events of "perf record"
+     through its control pipe. This has no effect on the thread tree
+     profiler, which always captures events.
+  */
   void Perf::pause() {
-    // TODO
+    if (this->perf_event.name != "<thread_tree>" &&
+        !this->send_control_command("disable")) {
+      adaptyst_print(module_id, ("Profiler \"" + this->name + "\" hasn't acknowledged "
+                                 "pausing event capturing.").c_str(), true, false, "General");
+    }
+  }
+
+  /**
+     Makes "perf record" finish through its control pipe. This is
+     needed when it is attached to already running processes (see
+     set_target()), which may run much longer than profiling.
+  */
+  void Perf::stop() {
+    if (this->running && !this->send_control_command("stop")) {
+      adaptyst_print(module_id, ("Profiler \"" + this->name + "\" hasn't acknowledged "
+                                 "stopping.").c_str(), true, false, "General");
+    }
   }
 
   int Perf::wait() {
@@ -597,4 +940,12 @@ namespace adaptyst {
   std::vector<std::unique_ptr<Requirement> > &Perf::get_requirements() {
     return this->requirements;
   }
+
+  Profiler::WireFormat Perf::get_wire_format() {
+    return this->wire_format;
+  }
+
+  PerfDataReader *Perf::get_raw_reader() {
+    return this->raw_reader.get();
+  }
 };
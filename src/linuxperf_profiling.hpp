@@ -15,9 +15,11 @@
 #include <sched.h>
 #include <thread>
 #include <future>
+#include <mutex>
 #include <adaptyst/socket.hpp>
 #include <adaptyst/process.hpp>
 #include <adaptyst/amod_t.h>
+#include "linuxperf_perf_data.hpp"
 
 extern amod_t module_id;
 
@@ -120,6 +122,21 @@ namespace adaptyst {
      A class describing a profiler.
   */
   class Profiler {
+  public:
+    /**
+       A format of messages sent by the profiler through
+       non-generic connections.
+
+       RAW means that no connections are established and samples
+       are decoded directly from the profiler output with the reader
+       returned by get_raw_reader().
+    */
+    enum WireFormat {
+      JSON,
+      BINARY,
+      RAW
+    };
+
   protected:
     Acceptor::Factory &acceptor_factory;
     std::vector<std::unique_ptr<Connection> > connections;
@@ -191,6 +208,23 @@ namespace adaptyst {
     */
     virtual std::vector<std::unique_ptr<Requirement> > &get_requirements() = 0;
 
+    /**
+       Gets the format of messages sent by the profiler through
+       non-generic connections.
+    */
+    virtual WireFormat get_wire_format() = 0;
+
+    /**
+       Gets the reader decoding the profiler output directly if
+       the wire format is RAW, nullptr otherwise.
+
+       WARNING: nullptr will be returned if start() hasn't been
+       called before.
+    */
+    virtual PerfDataReader *get_raw_reader() {
+      return nullptr;
+    }
+
     /**
        Gets the connections used for exchanging messages with
        the profiler. The first connection in the vector is used for
@@ -214,6 +248,7 @@ namespace adaptyst {
     std::vector<std::string> options;
     std::string human_title;
     std::string unit;
+    std::vector<PerfEvent> events;
 
   public:
     friend class Perf;
@@ -225,7 +260,8 @@ namespace adaptyst {
     PerfEvent(int freq,
               int off_cpu_freq,
               int buffer_events,
-              int buffer_off_cpu_events);
+              int buffer_off_cpu_events,
+              std::vector<PerfEvent> group_events = {});
 
     // For custom event profiling
     PerfEvent(std::string name,
@@ -234,7 +270,11 @@ namespace adaptyst {
               std::string human_title,
               std::string unit);
 
+    // For custom event profiling of multiple events at once
+    PerfEvent(std::vector<PerfEvent> &events);
+
     std::string get_name();
+    std::string get_type();
     std::string get_human_title();
     std::string get_unit();
   };
@@ -265,6 +305,18 @@ namespace adaptyst {
       std::vector<std::vector<std::string> > data;
     };
 
+    /**
+       A class describing already running processes which
+       "perf record" attaches to instead of the profiled command:
+       either a set of PIDs or all processes in a cgroup (if cgroup
+       is not empty).
+    */
+    class Target {
+    public:
+      std::vector<pid_t> pids;
+      std::string cgroup;
+    };
+
   private:
     fs::path perf_bin_path;
     fs::path perf_python_path;
@@ -279,7 +331,20 @@ namespace adaptyst {
     std::unique_ptr<Process> script_proc;
     CaptureMode capture_mode;
     Filter filter;
+    WireFormat wire_format;
+    Target target;
+    fs::path fifo_path;
+    std::unique_ptr<PerfDataReader> raw_reader;
     bool running;
+    fs::path control_path;
+    fs::path ack_path;
+    int control_fd;
+    int ack_fd;
+    std::mutex control_mutex;
+
+    void unblock_raw_reader();
+    bool send_control_command(std::string command);
+    void close_control();
 
   public:
     Perf(Acceptor::Factory &acceptor_factory,
@@ -291,16 +356,21 @@ namespace adaptyst {
          CPUConfig &cpu_config,
          std::string name,
          CaptureMode capture_mode,
-         Filter filter);
+         Filter filter,
+         WireFormat wire_format);
     ~Perf() {}
     std::string get_name();
+    void set_target(Target target);
     void start(pid_t pid,
                bool capture_immediately);
     unsigned int get_thread_count();
     void resume();
     void pause();
+    void stop();
     int wait();
     std::vector<std::unique_ptr<Requirement> > &get_requirements();
+    WireFormat get_wire_format();
+    PerfDataReader *get_raw_reader();
   };
 };
 
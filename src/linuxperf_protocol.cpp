@@ -0,0 +1,102 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "linuxperf_protocol.hpp"
+#include <algorithm>
+
+#define MIN_FRAME_BUFFER_SIZE 65536
+
+namespace adaptyst {
+  /**
+     Constructs a FrameReader object.
+
+     @param connection The connection to read frames from.
+     @param buf_size   The initial size of the internal buffer in bytes.
+                       The buffer grows automatically if a frame
+                       does not fit.
+  */
+  FrameReader::FrameReader(Connection &connection,
+                           unsigned int buf_size) : connection(connection) {
+    this->buf.resize(std::max<std::size_t>(buf_size, MIN_FRAME_BUFFER_SIZE));
+    this->begin = 0;
+    this->end = 0;
+    this->consumed = 0;
+  }
+
+  /**
+     Makes sure that at least a given number of bytes is available
+     in the internal buffer starting from this->begin.
+
+     @throw ConnectionException When the connection is closed before
+                                enough bytes are received.
+  */
+  void FrameReader::fill(std::size_t size) {
+    if (this->begin + size > this->buf.size()) {
+      std::memmove(this->buf.data(), this->buf.data() + this->begin,
+                   this->end - this->begin);
+      this->end -= this->begin;
+      this->begin = 0;
+
+      if (size > this->buf.size()) {
+        this->buf.resize(size);
+      }
+    }
+
+    while (this->end - this->begin < size) {
+      int bytes = this->connection.read(this->buf.data() + this->end,
+                                        this->buf.size() - this->end);
+
+      if (bytes <= 0) {
+        throw ConnectionException();
+      }
+
+      this->end += bytes;
+    }
+  }
+
+  /**
+     Reads the next frame and returns its payload.
+
+     The returned view is valid only until the next call to read().
+
+     @throw ConnectionException When the connection is closed in the
+                                middle of a frame.
+  */
+  std::string_view FrameReader::read() {
+    this->begin = this->consumed;
+    this->fill(sizeof(std::uint32_t));
+
+    std::uint32_t size;
+    std::memcpy(&size, this->buf.data() + this->begin, sizeof(std::uint32_t));
+
+    this->fill(sizeof(std::uint32_t) + size);
+    this->consumed = this->begin + sizeof(std::uint32_t) + size;
+
+    return std::string_view(this->buf.data() + this->begin +
+                            sizeof(std::uint32_t), size);
+  }
+
+  /**
+     Reads the next string of a given size.
+
+     @throw std::out_of_range When the payload is too short.
+  */
+  std::string_view FrameParser::get_string(std::size_t size) {
+    if (this->pos + size > this->payload.size()) {
+      throw std::out_of_range("Binary frame is truncated");
+    }
+
+    std::string_view result = this->payload.substr(this->pos, size);
+    this->pos += size;
+    return result;
+  }
+
+  /**
+     Reads everything left in the payload.
+  */
+  std::string_view FrameParser::get_rest() {
+    std::string_view result = this->payload.substr(this->pos);
+    this->pos = this->payload.size();
+    return result;
+  }
+};
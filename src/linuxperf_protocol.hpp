@@ -0,0 +1,86 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef LINUXPERF_PROTOCOL_HPP_
+#define LINUXPERF_PROTOCOL_HPP_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <adaptyst/socket.hpp>
+#include "linuxperf_symbols.hpp"
+
+namespace adaptyst {
+  /**
+     Frame types of the binary wire format used by event-handler.py
+     for sending messages through non-generic connections.
+
+     Every frame is a native-endian 32-bit payload length followed by
+     the payload, the first byte of which is one of the values below.
+     FRAME_MESSAGE carries a regular JSON message (as sent in the JSON
+     wire format), FRAME_SAMPLE carries a packed sample (see
+     event-handler.py for the exact layout), and FRAME_STOP marks the end
+     of the stream.
+  */
+  enum FrameType : unsigned char {
+    FRAME_MESSAGE = 0,
+    FRAME_SAMPLE = 1,
+    FRAME_STOP = 2
+  };
+
+  /**
+     A class reading length-prefixed binary frames from a connection.
+  */
+  class FrameReader {
+  private:
+    Connection &connection;
+    std::vector<char> buf;
+    std::size_t begin;
+    std::size_t end;
+    std::size_t consumed;
+
+    void fill(std::size_t size);
+
+  public:
+    FrameReader(Connection &connection,
+                unsigned int buf_size);
+    std::string_view read();
+  };
+
+  /**
+     A class decoding packed fields of a binary frame payload.
+  */
+  class FrameParser {
+  private:
+    std::string_view payload;
+    std::size_t pos;
+
+  public:
+    FrameParser(std::string_view payload) : payload(payload), pos(0) {}
+
+    /**
+       Reads the next field of a trivially-copyable type T.
+
+       @throw std::out_of_range When the payload is too short.
+    */
+    template<typename T>
+    T get() {
+      if (this->pos + sizeof(T) > this->payload.size()) {
+        throw std::out_of_range("Binary frame is truncated");
+      }
+
+      T result;
+      std::memcpy(&result, this->payload.data() + this->pos, sizeof(T));
+      this->pos += sizeof(T);
+      return result;
+    }
+
+    std::string_view get_string(std::size_t size);
+    std::string_view get_rest();
+  };
+};
+
+#endif
@@ -0,0 +1,522 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "linuxperf_sources.hpp"
+#include "linuxperf_symbols.hpp"
+#include <adaptyst/hw.h>
+#include <adaptyst/amod_t.h>
+#include <boost/algorithm/string.hpp>
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <spawn.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+extern amod_t module_id;
+
+namespace adaptyst {
+  /**
+     Spawns addr2line for a given executable/library.
+
+     @throw std::runtime_error In case of any errors.
+  */
+  Addr2line::Addr2line(const std::string &dso) {
+    int stdin_pipe[2];
+    int stdout_pipe[2];
+
+    if (pipe2(stdin_pipe, O_CLOEXEC) == -1) {
+      throw std::runtime_error("Could not create a pipe for addr2line: " +
+                               std::string(std::strerror(errno)));
+    }
+
+    if (pipe2(stdout_pipe, O_CLOEXEC) == -1) {
+      int error = errno;
+      close(stdin_pipe[0]);
+      close(stdin_pipe[1]);
+      throw std::runtime_error("Could not create a pipe for addr2line: " +
+                               std::string(std::strerror(error)));
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // dup2() clears O_CLOEXEC of the target descriptors.
+    posix_spawn_file_actions_adddup2(&actions, stdin_pipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+
+    // Workers block SIGPIPE (see SourceResolver::resolve_batch()),
+    // which must not be inherited by addr2line.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+    posix_spawnattr_setsigmask(&attr, &empty_set);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    std::string dso_arg = dso;
+    char *argv[] = {(char *)"addr2line", (char *)"-e", dso_arg.data(), nullptr};
+
+    int result = posix_spawnp(&this->pid, "addr2line", &actions, &attr,
+                              argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    close(stdin_pipe[0]);
+    close(stdout_pipe[1]);
+
+    if (result != 0) {
+      close(stdin_pipe[1]);
+      close(stdout_pipe[0]);
+      throw std::runtime_error("Could not start addr2line: " +
+                               std::string(std::strerror(result)));
+    }
+
+    this->stdin_fd = stdin_pipe[1];
+    this->stdout_fd = stdout_pipe[0];
+
+    fcntl(this->stdin_fd, F_SETFL, fcntl(this->stdin_fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  Addr2line::~Addr2line() {
+    if (this->stdin_fd != -1) {
+      close(this->stdin_fd);
+    }
+
+    close(this->stdout_fd);
+
+    int status;
+    while (waitpid(this->pid, &status, 0) == -1 && errno == EINTR) {}
+  }
+
+  /**
+     Resolves offsets to source code locations. Offsets that can't
+     be resolved are omitted in the results.
+
+     All offsets are written to addr2line while its output is being
+     read, so neither side waits for the other one to drain a pipe.
+     This can be called only once per object, as the stdin pipe
+     is closed after writing the last offset.
+
+     @param offsets The offsets to resolve.
+     @param results The vector where (offset, location) pairs
+                    should be appended to.
+  */
+  void Addr2line::resolve(const std::vector<std::uint64_t> &offsets,
+                          std::vector<std::pair<std::uint64_t, SourceLocation> > &results) {
+    std::string input;
+
+    for (std::uint64_t offset : offsets) {
+      input += to_hex(offset) + '\n';
+    }
+
+    std::size_t written = 0;
+    std::size_t lines_read = 0;
+    std::string pending;
+    char buf[65536];
+
+    while (lines_read < offsets.size()) {
+      struct pollfd fds[2];
+      fds[0] = {this->stdout_fd, POLLIN, 0};
+      fds[1] = {this->stdin_fd, POLLOUT, 0};
+
+      if (poll(fds, this->stdin_fd == -1 ? 1 : 2, -1) == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        throw std::runtime_error("Could not poll addr2line: " +
+                                 std::string(std::strerror(errno)));
+      }
+
+      if (this->stdin_fd != -1 && fds[1].revents != 0) {
+        ssize_t bytes = write(this->stdin_fd, input.data() + written,
+                              input.size() - written);
+
+        if (bytes == -1 && errno != EAGAIN && errno != EINTR) {
+          throw std::runtime_error("Could not write to addr2line: " +
+                                   std::string(std::strerror(errno)));
+        }
+
+        if (bytes > 0) {
+          written += bytes;
+        }
+
+        if (written == input.size()) {
+          close(this->stdin_fd);
+          this->stdin_fd = -1;
+        }
+      }
+
+      if (fds[0].revents != 0) {
+        ssize_t bytes = read(this->stdout_fd, buf, sizeof(buf));
+
+        if (bytes == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+
+          throw std::runtime_error("Could not read from addr2line: " +
+                                   std::string(std::strerror(errno)));
+        } else if (bytes == 0) {
+          throw std::runtime_error("addr2line has exited prematurely");
+        }
+
+        pending.append(buf, bytes);
+
+        std::size_t start = 0;
+        std::size_t end;
+
+        while ((end = pending.find('\n', start)) != std::string::npos) {
+          std::vector<std::string> parts;
+          boost::split(parts, pending.substr(start, end - start), boost::is_any_of(":"));
+
+          // "??:0" and "<file>:?" mean that addr2line couldn't resolve
+          // an offset.
+          if (parts.size() == 2 && parts[0] != "??") {
+            try {
+              int line = std::stoi(parts[1]);
+
+              if (line > 0) {
+                results.push_back(std::make_pair(offsets[lines_read],
+                                                 SourceLocation{parts[0], line}));
+              }
+            } catch (...) {
+            }
+          }
+
+          lines_read++;
+          start = end + 1;
+        }
+
+        pending.erase(0, start);
+      }
+    }
+  }
+
+  /**
+     Constructs a SourceResolver object.
+
+     @param worker_count The number of workers (threads) to use.
+     @param cache_dir    The directory where the persistent cache
+                         should be stored.
+  */
+  SourceResolver::SourceResolver(unsigned int worker_count, fs::path cache_dir) :
+    pool(worker_count == 0 ? 1 : worker_count) {
+    this->cache_dir = cache_dir;
+  }
+
+  /**
+     Reads the build ID of an executable/library and loads its cached
+     source code locations. This must be called with the mutex
+     of the Dso object held.
+  */
+  void SourceResolver::prepare_dso(const std::string &dso, Dso &dso_data) {
+    dso_data.prepared = true;
+    dso_data.build_id = LineTable::read_build_id(dso);
+
+    if (dso_data.build_id.empty()) {
+      return;
+    }
+
+    std::ifstream cache_file(this->cache_dir / dso_data.build_id);
+    std::string line;
+
+    // Every line has the form of "<offset in hex>\t<line>\t<file>".
+    while (std::getline(cache_file, line)) {
+      std::vector<std::string> parts;
+      boost::split(parts, line, boost::is_any_of("\t"));
+
+      if (parts.size() < 3) {
+        continue;
+      }
+
+      try {
+        std::uint64_t offset = std::stoull(parts[0], nullptr, 16);
+        int line_number = std::stoi(parts[1]);
+
+        // File paths may contain tabs.
+        std::string file = line.substr(parts[0].size() + parts[1].size() + 2);
+
+        dso_data.cache[offset] = SourceLocation{file, line_number};
+      } catch (...) {
+      }
+    }
+  }
+
+  void SourceResolver::add_result(const std::string &dso, std::uint64_t offset,
+                                  const SourceLocation &location) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->files.insert(location.file);
+    this->results[dso][offset] = location;
+  }
+
+  void SourceResolver::resolve_dso(std::string dso,
+                                   std::vector<std::uint64_t> offsets) {
+    Dso *dso_data;
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      dso_data = this->dsos[dso].get();
+    }
+
+    std::vector<std::uint64_t> remaining;
+
+    {
+      std::lock_guard<std::mutex> lock(dso_data->mutex);
+
+      if (!dso_data->prepared) {
+        this->prepare_dso(dso, *dso_data);
+      }
+
+      for (std::uint64_t offset : offsets) {
+        auto it = dso_data->cache.find(offset);
+
+        if (it == dso_data->cache.end()) {
+          remaining.push_back(offset);
+        } else if (it->second.line != 0) {
+          this->add_result(dso, offset, it->second);
+        }
+      }
+
+      if (remaining.empty()) {
+        return;
+      }
+
+      // Line tables are read only when the cache is not enough.
+      if (!dso_data->line_table) {
+        dso_data->line_table = std::make_unique<LineTable>(dso);
+      }
+
+      LineTable &line_table = *dso_data->line_table;
+
+      if (line_table.get_state() == LineTable::NO_DEBUG_INFO) {
+        return;
+      }
+
+      if (line_table.get_state() == LineTable::READY) {
+        std::vector<std::uint64_t> unknown;
+
+        for (std::uint64_t offset : remaining) {
+          SourceLocation location{"", 0};
+
+          switch (line_table.lookup(offset, location.file, location.line)) {
+          case LineTable::FOUND:
+            this->add_result(dso, offset, location);
+            dso_data->cache[offset] = location;
+            break;
+
+          case LineTable::NOT_FOUND:
+            dso_data->cache[offset] = SourceLocation{"", 0};
+            break;
+
+          case LineTable::UNKNOWN:
+            unknown.push_back(offset);
+            break;
+          }
+        }
+
+        dso_data->cache_modified = true;
+        remaining = std::move(unknown);
+      }
+    }
+
+    for (std::size_t i = 0; i < remaining.size(); i += BATCH_SIZE) {
+      std::vector<std::uint64_t> batch(remaining.begin() + i,
+                                       remaining.begin() + std::min(i + BATCH_SIZE,
+                                                                    remaining.size()));
+      boost::asio::post(this->pool, [this, dso, batch]() {
+        this->resolve_batch(dso, batch);
+      });
+    }
+  }
+
+  void SourceResolver::resolve_batch(std::string dso,
+                                     std::vector<std::uint64_t> offsets) {
+    // Writing to addr2line after it has exited must result in an
+    // error rather than terminating the whole process.
+    sigset_t sigpipe_set;
+    sigemptyset(&sigpipe_set);
+    sigaddset(&sigpipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe_set, nullptr);
+
+    std::vector<std::pair<std::uint64_t, SourceLocation> > batch_results;
+
+    try {
+      Addr2line addr2line(dso);
+      addr2line.resolve(offsets, batch_results);
+    } catch (std::exception &e) {
+      adaptyst_print(module_id, ("Could not resolve source code locations in " + dso +
+                                 ": " + e.what()).c_str(), true, false, "General");
+      return;
+    }
+
+    Dso *dso_data;
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      dso_data = this->dsos[dso].get();
+    }
+
+    std::lock_guard<std::mutex> lock(dso_data->mutex);
+
+    for (std::uint64_t offset : offsets) {
+      dso_data->cache[offset] = SourceLocation{"", 0};
+    }
+
+    for (auto &[offset, location] : batch_results) {
+      this->add_result(dso, offset, location);
+      dso_data->cache[offset] = location;
+    }
+
+    dso_data->cache_modified = true;
+  }
+
+  /**
+     Writes modified cache entries to the persistent cache. Every
+     cache file is replaced atomically, so concurrent profiling
+     sessions never see partially-written files.
+  */
+  void SourceResolver::save_cache() {
+    std::error_code error;
+    bool dir_created = false;
+
+    for (auto &[dso, dso_data] : this->dsos) {
+      if (!dso_data->cache_modified || dso_data->build_id.empty()) {
+        continue;
+      }
+
+      if (!dir_created) {
+        fs::create_directories(this->cache_dir, error);
+
+        if (error) {
+          adaptyst_print(module_id, ("Could not create " + this->cache_dir.string() +
+                                     ", source code locations won't be cached: " +
+                                     error.message()).c_str(), true, false, "General");
+          return;
+        }
+
+        dir_created = true;
+      }
+
+      fs::path path = this->cache_dir / dso_data->build_id;
+      fs::path tmp_path = path;
+      tmp_path += "." + std::to_string(getpid()) + ".tmp";
+
+      {
+        std::ofstream cache_file(tmp_path);
+
+        for (auto &[offset, location] : dso_data->cache) {
+          cache_file << to_hex(offset) << '\t' << location.line << '\t' << location.file << '\n';
+        }
+
+        if (!cache_file) {
+          fs::remove(tmp_path, error);
+          continue;
+        }
+      }
+
+      fs::rename(tmp_path, path, error);
+
+      if (error) {
+        fs::remove(tmp_path, error);
+      }
+    }
+  }
+
+  /**
+     Schedules the resolution of offsets in a given
+     executable/library.
+  */
+  void SourceResolver::add(const std::string &dso,
+                           const std::unordered_set<std::uint64_t> &offsets) {
+    std::vector<std::uint64_t> offsets_vector;
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+
+      auto it = this->dsos.find(dso);
+
+      if (it == this->dsos.end()) {
+        it = this->dsos.insert({dso, std::make_unique<Dso>()}).first;
+        it->second->prepared = false;
+        it->second->cache_modified = false;
+
+        // Pseudo-files like "[kernel.kallsyms]" or "[vdso]" can't be
+        // resolved and are not listed in sources.json.
+        std::error_code error;
+        it->second->resolvable = fs::is_regular_file(dso, error);
+
+        if (it->second->resolvable) {
+          this->results[dso];
+        }
+      }
+
+      if (!it->second->resolvable) {
+        return;
+      }
+
+      for (std::uint64_t offset : offsets) {
+        if (it->second->submitted.insert(offset).second) {
+          offsets_vector.push_back(offset);
+        }
+      }
+    }
+
+    if (offsets_vector.empty()) {
+      return;
+    }
+
+    boost::asio::post(this->pool, [this, dso, offsets_vector]() {
+      this->resolve_dso(dso, offsets_vector);
+    });
+  }
+
+  /**
+     Waits for all scheduled resolutions to finish and updates
+     the persistent cache. No resolutions can be scheduled afterwards.
+  */
+  void SourceResolver::wait() {
+    this->pool.join();
+    this->save_cache();
+  }
+
+  /**
+     Converts the results to the sources.json schema. This should be
+     called only after wait().
+  */
+  nlohmann::json SourceResolver::to_json() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    nlohmann::json result = nlohmann::json::object();
+
+    for (auto &[dso, locations] : this->results) {
+      nlohmann::json &dso_json = result[dso];
+      dso_json = nlohmann::json::object();
+
+      for (auto &[offset, location] : locations) {
+        nlohmann::json &offset_json = dso_json[to_hex(offset)];
+        offset_json["file"] = location.file;
+        offset_json["line"] = location.line;
+      }
+    }
+
+    return result;
+  }
+
+  /**
+     Gets the paths to all source files that at least one offset
+     has been resolved to. This should be called only after wait().
+  */
+  std::unordered_set<fs::path> &SourceResolver::get_source_files() {
+    return this->files;
+  }
+};
@@ -0,0 +1,115 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef LINUXPERF_SOURCES_HPP_
+#define LINUXPERF_SOURCES_HPP_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <filesystem>
+#include <cstdint>
+#include <sys/types.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <nlohmann/json.hpp>
+#include "linuxperf_dwarf.hpp"
+
+namespace adaptyst {
+  namespace fs = std::filesystem;
+
+  /**
+     A structure describing a source code location of an offset.
+  */
+  struct SourceLocation {
+    std::string file;
+    int line;
+  };
+
+  /**
+     A class describing an "addr2line -e <executable/library>" child
+     process.
+
+     The process is spawned with posix_spawn() and its stdin/stdout
+     pipes are created with O_CLOEXEC, so no other process spawned
+     concurrently (e.g. by another worker) inherits them. Otherwise,
+     closing the stdin pipe wouldn't make addr2line terminate.
+  */
+  class Addr2line {
+  private:
+    pid_t pid;
+    int stdin_fd;
+    int stdout_fd;
+
+  public:
+    Addr2line(const std::string &dso);
+    ~Addr2line();
+    void resolve(const std::vector<std::uint64_t> &offsets,
+                 std::vector<std::pair<std::uint64_t, SourceLocation> > &results);
+  };
+
+  /**
+     A class describing a pool of workers resolving offsets in
+     executables/libraries to source code locations.
+
+     Offsets can be added at any time (e.g. while profiling is still
+     running) and each offset is resolved only once, regardless of
+     how many times it is added.
+
+     Offsets are resolved in the following order:
+     1. By looking them up in the persistent cache stored in the
+        local config directory of the module. The cache is keyed by
+        build IDs, so it stays valid as long as executables/libraries
+        don't change.
+     2. By reading DWARF line tables in-process (see LineTable).
+     3. By addr2line, only if line tables can't be read in-process.
+        Such offsets are split into batches of at most BATCH_SIZE
+        offsets, each resolved by a separate worker task, so large
+        executables/libraries are spread across all workers.
+  */
+  class SourceResolver {
+  private:
+    static constexpr std::size_t BATCH_SIZE = 4096;
+
+    struct Dso {
+      std::mutex mutex;
+      bool resolvable;
+      bool prepared;
+      std::string build_id;
+      std::unique_ptr<LineTable> line_table;
+      std::unordered_set<std::uint64_t> submitted;
+
+      // Line 0 means that an offset can't be resolved.
+      std::unordered_map<std::uint64_t, SourceLocation> cache;
+      bool cache_modified;
+    };
+
+    boost::asio::thread_pool pool;
+    fs::path cache_dir;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<Dso> > dsos;
+    std::unordered_map<std::string, std::map<std::uint64_t, SourceLocation> > results;
+    std::unordered_set<fs::path> files;
+
+    void prepare_dso(const std::string &dso, Dso &dso_data);
+    void resolve_dso(std::string dso, std::vector<std::uint64_t> offsets);
+    void resolve_batch(std::string dso, std::vector<std::uint64_t> offsets);
+    void add_result(const std::string &dso, std::uint64_t offset,
+                    const SourceLocation &location);
+    void save_cache();
+
+  public:
+    SourceResolver(unsigned int worker_count, fs::path cache_dir);
+    void add(const std::string &dso,
+             const std::unordered_set<std::uint64_t> &offsets);
+    void wait();
+    nlohmann::json to_json();
+    std::unordered_set<fs::path> &get_source_files();
+  };
+};
+
+#endif
@@ -0,0 +1,65 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "linuxperf_symbols.hpp"
+#include <cstdio>
+
+namespace adaptyst {
+  /**
+     Gets the ID of a symbol, assigning a new one if the symbol
+     hasn't been seen before.
+
+     @param name The name of a symbol.
+     @param dso  The executable/library the symbol belongs to
+                 (or an empty string if unknown).
+  */
+  std::uint32_t SymbolTable::intern(const std::string &name,
+                                    const std::string &dso) {
+    std::string key = name + '\0' + dso;
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    auto it = this->ids.find(key);
+
+    if (it != this->ids.end()) {
+      return it->second;
+    }
+
+    std::uint32_t id = this->symbols.size();
+    this->symbols.push_back(std::make_pair(name, dso));
+    this->ids[key] = id;
+    return id;
+  }
+
+  /**
+     Converts the table to the callchains.json schema, i.e. an object
+     mapping IDs (as strings) to [name, dso] arrays.
+  */
+  nlohmann::json SymbolTable::to_json() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    nlohmann::json result = nlohmann::json::object();
+
+    for (std::size_t i = 0; i < this->symbols.size(); i++) {
+      result[std::to_string(i)] = {this->symbols[i].first, this->symbols[i].second};
+    }
+
+    return result;
+  }
+
+  /**
+     Converts a number to a hexadecimal string in the same format
+     as Python's hex() (e.g. "0x1a2b").
+  */
+  std::string to_hex(std::uint64_t value) {
+    char result[19];
+    std::snprintf(result, sizeof(result), "0x%llx", (unsigned long long)value);
+    return std::string(result);
+  }
+
+  /**
+     Converts an offset to the form used in the result files, i.e.
+     a hexadecimal string or an empty string for NO_OFFSET.
+  */
+  std::string offset_to_string(std::uint64_t offset) {
+    return offset == NO_OFFSET ? "" : to_hex(offset);
+  }
+};
@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef LINUXPERF_SYMBOLS_HPP_
+#define LINUXPERF_SYMBOLS_HPP_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+namespace adaptyst {
+  /**
+     The offset value of callchain elements not having any offset
+     (e.g. "(cut)"). It is also used in this meaning by
+     event-handler.py.
+  */
+  inline constexpr std::uint64_t NO_OFFSET = UINT64_MAX;
+
+  /**
+     A callchain element: an ID of a symbol in SymbolTable and
+     an offset (or NO_OFFSET).
+  */
+  typedef std::pair<std::uint32_t, std::uint64_t> CallchainElem;
+
+  std::string to_hex(std::uint64_t value);
+  std::string offset_to_string(std::uint64_t offset);
+
+  /**
+     A class describing a table of symbols shared by all profilers
+     and connections of a profiling session. Every distinct
+     (symbol name, executable/library) pair gets a consecutive
+     integer ID.
+
+     The class is thread-safe.
+  */
+  class SymbolTable {
+  private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::uint32_t> ids;
+    std::vector<std::pair<std::string, std::string> > symbols;
+
+  public:
+    std::uint32_t intern(const std::string &name,
+                         const std::string &dso);
+    nlohmann::json to_json();
+  };
+};
+
+#endif
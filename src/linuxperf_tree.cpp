@@ -0,0 +1,618 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "linuxperf_tree.hpp"
+#include <algorithm>
+
+namespace adaptyst {
+  /**
+     Adds values to an offset, creating its entry if it doesn't
+     exist yet.
+  */
+  void OffsetHistogram::add(std::uint64_t offset, std::uint64_t hot_value,
+                            std::uint64_t cold_value) {
+    auto it = std::lower_bound(this->entries.begin(), this->entries.end(), offset,
+                               [](const Entry &entry, std::uint64_t offset) {
+                                 return entry.offset < offset;
+                               });
+
+    if (it == this->entries.end() || it->offset != offset) {
+      it = this->entries.insert(it, {offset, 0, 0});
+    }
+
+    it->hot_value += hot_value;
+    it->cold_value += cold_value;
+  }
+
+  /**
+     Writes the histogram as the "offsets" object of the
+     untimed.json/timed.json schema. This is the only place where
+     offsets are converted to strings.
+  */
+  void OffsetHistogram::write(JsonWriter &writer) {
+    std::vector<std::pair<std::string, Entry *> > sorted;
+
+    for (auto &entry : this->entries) {
+      sorted.push_back(std::make_pair(offset_to_string(entry.offset), &entry));
+    }
+
+    // Keys of JSON objects are written in the sorted order
+    // (see JsonWriter), which is not the numeric order of offsets.
+    std::sort(sorted.begin(), sorted.end(),
+              [](auto &a, auto &b) { return a.first < b.first; });
+
+    writer.begin_object();
+
+    for (auto &[offset, entry] : sorted) {
+      writer.key(offset);
+      writer.begin_object();
+      writer.key("cold_value");
+      writer.value(entry->cold_value);
+      writer.key("hot_value");
+      writer.value(entry->hot_value);
+      writer.end_object();
+    }
+
+    writer.end_object();
+  }
+
+  /**
+     Writes the members of a tree node following "children"
+     and closes the node object.
+  */
+  static void write_node_end(JsonWriter &writer, std::string name,
+                             std::uint64_t hot_value, std::uint64_t cold_value,
+                             OffsetHistogram *offsets) {
+    writer.end_array();
+    writer.key("cold_value");
+    writer.value(cold_value);
+    writer.key("hot_value");
+    writer.value(hot_value);
+    writer.key("name");
+    writer.value(name);
+
+    if (offsets) {
+      writer.key("offsets");
+      offsets->write(writer);
+    }
+
+    writer.key("value");
+    writer.value(hot_value + cold_value);
+    writer.end_object();
+  }
+
+  /**
+     Constructs a CallTree object with the root node ("all") only.
+  */
+  CallTree::CallTree() {
+    this->nodes.push_back({NONE, NONE, NONE, 0, 0, OffsetHistogram()});
+  }
+
+  std::uint32_t CallTree::get_child(std::uint32_t parent, std::uint32_t symbol) {
+    std::uint64_t key = ((std::uint64_t)parent << 32) | symbol;
+    auto it = this->edges.find(key);
+
+    if (it != this->edges.end()) {
+      return it->second;
+    }
+
+    std::uint32_t index = this->nodes.size();
+    this->nodes.push_back({symbol, NONE, this->nodes[parent].first_child, 0, 0, OffsetHistogram()});
+    this->nodes[parent].first_child = index;
+    this->edges[key] = index;
+    return index;
+  }
+
+  /**
+     Gets the number of nodes of the tree, including the root.
+  */
+  std::size_t CallTree::get_node_count() {
+    return this->nodes.size();
+  }
+
+  /**
+     Copies nodes of the tree to the same positions in another tree,
+     so that a large tree can be copied in parts while samples are
+     still being added to it. The copy can only be written (see
+     write()) and not have samples added.
+
+     Nodes are only ever appended and their links only ever point
+     to nodes existing at the time, so the copy is a valid tree once
+     all nodes up to get_node_count() have been copied, even if
+     samples have been added in the meantime. Such samples may be
+     counted in some nodes of the copy and not in others.
+
+     @param target The tree to copy the nodes to.
+     @param begin  The index of the first node to copy.
+     @param count  The maximum number of nodes to copy.
+
+     @return The index after the last node copied.
+  */
+  std::size_t CallTree::copy_nodes(CallTree &target, std::size_t begin,
+                                   std::size_t count) {
+    std::size_t end = std::min(this->nodes.size(), begin + count);
+
+    if (target.nodes.size() < end) {
+      target.nodes.resize(end);
+    }
+
+    std::copy(this->nodes.begin() + begin, this->nodes.begin() + end,
+              target.nodes.begin() + begin);
+    return end;
+  }
+
+  /**
+     Adds a sample to the tree.
+
+     @param callchain The callchain of a sample, ordered from the
+                      outermost frame to the innermost one.
+     @param period    The period of a sample.
+     @param offcpu    Indicates whether the sample is an off-CPU one,
+                      i.e. whether the period should be added to cold
+                      values rather than hot ones.
+  */
+  void CallTree::add_sample(std::vector<CallchainElem> &callchain,
+                            std::uint64_t period, bool offcpu) {
+    std::uint32_t cur = 0;
+
+    if (offcpu) {
+      this->nodes[cur].cold_value += period;
+    } else {
+      this->nodes[cur].hot_value += period;
+    }
+
+    for (auto &elem : callchain) {
+      cur = this->get_child(cur, elem.first);
+      Node &node = this->nodes[cur];
+
+      if (offcpu) {
+        node.cold_value += period;
+        node.offsets.add(elem.second, 0, period);
+      } else {
+        node.hot_value += period;
+        node.offsets.add(elem.second, period, 0);
+      }
+    }
+  }
+
+  /**
+     Writes the tree in the untimed.json schema. Children of every
+     node are ordered by their names, i.e. symbol IDs converted
+     to strings.
+
+     The tree is traversed depth-first with an explicit stack, so
+     neither deep trees nor large ones require any intermediate
+     JSON representation.
+  */
+  void CallTree::write(JsonWriter &writer) {
+    struct Visit {
+      std::uint32_t node;
+      std::vector<std::pair<std::string, std::uint32_t> > children;
+      std::size_t next_child;
+    };
+
+    std::vector<Visit> stack;
+
+    auto enter = [&](std::uint32_t index) {
+      Visit visit{index, {}, 0};
+
+      for (std::uint32_t child = this->nodes[index].first_child; child != NONE;
+           child = this->nodes[child].next_sibling) {
+        visit.children.push_back(std::make_pair(std::to_string(this->nodes[child].symbol),
+                                                child));
+      }
+
+      std::sort(visit.children.begin(), visit.children.end());
+
+      writer.begin_object();
+      writer.key("children");
+      writer.begin_array();
+      stack.push_back(std::move(visit));
+    };
+
+    enter(0);
+
+    while (!stack.empty()) {
+      Visit &visit = stack.back();
+
+      if (visit.next_child < visit.children.size()) {
+        enter(visit.children[visit.next_child++].second);
+        continue;
+      }
+
+      Node &node = this->nodes[visit.node];
+      write_node_end(writer, visit.node == 0 ? "all" : std::to_string(node.symbol),
+                     node.hot_value, node.cold_value,
+                     visit.node == 0 ? nullptr : &node.offsets);
+      stack.pop_back();
+    }
+  }
+
+  /**
+     Constructs a StackTable object with the empty stack only
+     (having both IDs equal to 0).
+  */
+  StackTable::StackTable() {
+    this->frame_nodes.push_back({0, 0, 0});
+    this->symbol_nodes.push_back({0, 0});
+  }
+
+  /**
+     Adds a stack to the table if it is not there yet and returns
+     its frame stack ID and symbol stack ID (in this order).
+
+     @param callchain The callchain of a sample, ordered from the
+                      outermost frame to the innermost one.
+  */
+  std::pair<std::uint32_t, std::uint32_t>
+  StackTable::add(std::vector<CallchainElem> &callchain) {
+    std::uint32_t frame_stack = 0;
+    std::uint32_t symbol_stack = 0;
+
+    for (auto &elem : callchain) {
+      std::uint32_t symbol = elem.first;
+      std::uint64_t offset = elem.second;
+
+      FrameKey frame_key = {frame_stack, symbol, offset};
+      auto frame_it = this->frame_edges.find(frame_key);
+
+      if (frame_it == this->frame_edges.end()) {
+        frame_it = this->frame_edges.insert({frame_key,
+                                             (std::uint32_t)this->frame_nodes.size()}).first;
+        this->frame_nodes.push_back({frame_stack, symbol, offset});
+      }
+
+      frame_stack = frame_it->second;
+
+      std::uint64_t symbol_key = ((std::uint64_t)symbol_stack << 32) | symbol;
+      auto symbol_it = this->symbol_edges.find(symbol_key);
+
+      if (symbol_it == this->symbol_edges.end()) {
+        symbol_it = this->symbol_edges.insert({symbol_key,
+                                               (std::uint32_t)this->symbol_nodes.size()}).first;
+        this->symbol_nodes.push_back({symbol_stack, symbol});
+      }
+
+      symbol_stack = symbol_it->second;
+    }
+
+    return std::make_pair(frame_stack, symbol_stack);
+  }
+
+  /**
+     Gets the symbol IDs of a symbol stack, ordered from
+     the outermost frame to the innermost one.
+  */
+  void StackTable::get_symbols(std::uint32_t symbol_stack,
+                               std::vector<std::uint32_t> &symbols) {
+    symbols.clear();
+
+    for (std::uint32_t cur = symbol_stack; cur != 0; cur = this->symbol_nodes[cur].parent) {
+      symbols.push_back(this->symbol_nodes[cur].symbol);
+    }
+
+    std::reverse(symbols.begin(), symbols.end());
+  }
+
+  /**
+     Gets the offsets of a frame stack, ordered from
+     the outermost frame to the innermost one.
+  */
+  void StackTable::get_offsets(std::uint32_t frame_stack,
+                               std::vector<std::uint64_t> &offsets) {
+    offsets.clear();
+
+    for (std::uint32_t cur = frame_stack; cur != 0; cur = this->frame_nodes[cur].parent) {
+      offsets.push_back(this->frame_nodes[cur].offset);
+    }
+
+    std::reverse(offsets.begin(), offsets.end());
+  }
+
+  /**
+     Gets the callchain of a frame stack, ordered from
+     the outermost frame to the innermost one.
+  */
+  void StackTable::get_callchain(std::uint32_t frame_stack,
+                                 std::vector<CallchainElem> &callchain) {
+    callchain.clear();
+
+    for (std::uint32_t cur = frame_stack; cur != 0; cur = this->frame_nodes[cur].parent) {
+      callchain.push_back(std::make_pair(this->frame_nodes[cur].symbol,
+                                         this->frame_nodes[cur].offset));
+    }
+
+    std::reverse(callchain.begin(), callchain.end());
+  }
+
+  /**
+     Gets the approximate number of bytes allocated for the table,
+     including the hash maps used for looking stacks up.
+  */
+  std::size_t StackTable::get_memory_usage() {
+    // Every hash map element is a separately allocated node with
+    // a pointer to the next one and a cached hash.
+    return this->frame_nodes.capacity() * sizeof(FrameNode) +
+      this->symbol_nodes.capacity() * sizeof(SymbolNode) +
+      this->frame_edges.size() * (sizeof(std::pair<FrameKey, std::uint32_t>) +
+                                  2 * sizeof(void *)) +
+      this->frame_edges.bucket_count() * sizeof(void *) +
+      this->symbol_edges.size() * (sizeof(std::pair<std::uint64_t, std::uint32_t>) +
+                                   2 * sizeof(void *)) +
+      this->symbol_edges.bucket_count() * sizeof(void *);
+  }
+
+  /**
+     Constructs a TimedSequence object.
+
+     @param stack_table The stack table to store stacks in. It must
+                        outlive the constructed object.
+  */
+  TimedSequence::TimedSequence(StackTable &stack_table) : stack_table(stack_table) {}
+
+  /**
+     Adds a sample to the sequence.
+
+     @param callchain The callchain of a sample, ordered from the
+                      outermost frame to the innermost one.
+     @param period    The period of a sample.
+     @param offcpu    Indicates whether the sample is an off-CPU one,
+                      i.e. whether the period should be added to cold
+                      values rather than hot ones.
+  */
+  void TimedSequence::add_sample(std::vector<CallchainElem> &callchain,
+                                 std::uint64_t period, bool offcpu) {
+    auto [frame_stack, symbol_stack] = this->stack_table.add(callchain);
+
+    if (offcpu) {
+      this->add(frame_stack, symbol_stack, 0, period);
+    } else {
+      this->add(frame_stack, symbol_stack, period, 0);
+    }
+  }
+
+  /**
+     Appends all samples of another sequence to the end of this
+     sequence, e.g. when a thread is moved between connections.
+     The sequences may use different stack tables.
+  */
+  void TimedSequence::append(TimedSequence &other) {
+    std::unordered_map<std::uint32_t, std::pair<std::uint32_t, std::uint32_t> > stacks;
+    std::vector<CallchainElem> callchain;
+
+    for (Run &run : other.runs) {
+      for (std::uint32_t i = run.first_entry; i < run.first_entry + run.entry_count; i++) {
+        Entry &entry = other.entries[i];
+        auto stack = stacks.find(entry.frame_stack);
+
+        if (stack == stacks.end()) {
+          other.stack_table.get_callchain(entry.frame_stack, callchain);
+          stack = stacks.insert({entry.frame_stack, this->stack_table.add(callchain)}).first;
+        }
+
+        this->add(stack->second.first, stack->second.second,
+                  entry.hot_value, entry.cold_value);
+      }
+    }
+  }
+
+  /**
+     Gets the number of bytes allocated for the runs of the sequence,
+     not counting the shared stack table.
+  */
+  std::size_t TimedSequence::get_memory_usage() {
+    return this->runs.capacity() * sizeof(Run) +
+      this->entries.capacity() * sizeof(Entry);
+  }
+
+  /**
+     Coarsens the older half of the runs of the sequence, so that
+     it takes less memory while recent samples keep their full
+     time resolution.
+
+     The older runs are split into COMPACTION_BUCKETS buckets of
+     roughly equal value (i.e. time, as periods are times for
+     task-clock and offcpu-time) and all runs with the same symbol
+     stack within a bucket are merged into one, in the order of their
+     first appearance. The totals of every stack and offset are
+     preserved, only the order of samples within a bucket is lost.
+     Calling this repeatedly makes the oldest samples progressively
+     coarser, as the buckets of every call span more time.
+  */
+  void TimedSequence::compact() {
+    std::size_t end = this->runs.size() / 2;
+
+    if (end == 0) {
+      return;
+    }
+
+    std::uint64_t total_value = 0;
+
+    for (std::size_t i = 0; i < end; i++) {
+      total_value += this->runs[i].hot_value + this->runs[i].cold_value;
+    }
+
+    std::uint64_t bucket_value = total_value / COMPACTION_BUCKETS + 1;
+
+    std::vector<Run> old_runs;
+    std::vector<Entry> old_entries;
+    old_runs.swap(this->runs);
+    old_entries.swap(this->entries);
+
+    auto add_run = [this, &old_entries](Run &run) {
+      for (std::uint32_t i = run.first_entry; i < run.first_entry + run.entry_count; i++) {
+        Entry &entry = old_entries[i];
+        this->add(entry.frame_stack, run.symbol_stack, entry.hot_value, entry.cold_value);
+      }
+    };
+
+    // Symbol stacks of the current bucket in the order of their
+    // first appearance, each with the indices of its runs
+    std::vector<std::uint32_t> bucket_stacks;
+    std::unordered_map<std::uint32_t, std::vector<std::size_t> > bucket_runs;
+    std::uint64_t bucket_fill = 0;
+
+    auto flush_bucket = [&]() {
+      for (std::uint32_t symbol_stack : bucket_stacks) {
+        for (std::size_t index : bucket_runs[symbol_stack]) {
+          add_run(old_runs[index]);
+        }
+      }
+
+      bucket_stacks.clear();
+      bucket_runs.clear();
+      bucket_fill = 0;
+    };
+
+    for (std::size_t i = 0; i < end; i++) {
+      Run &run = old_runs[i];
+      auto [it, inserted] = bucket_runs.try_emplace(run.symbol_stack);
+
+      if (inserted) {
+        bucket_stacks.push_back(run.symbol_stack);
+      }
+
+      it->second.push_back(i);
+      bucket_fill += run.hot_value + run.cold_value;
+
+      if (bucket_fill >= bucket_value) {
+        flush_bucket();
+      }
+    }
+
+    flush_bucket();
+
+    for (std::size_t i = end; i < old_runs.size(); i++) {
+      add_run(old_runs[i]);
+    }
+
+    this->runs.shrink_to_fit();
+    this->entries.shrink_to_fit();
+  }
+
+  void TimedSequence::add(std::uint32_t frame_stack, std::uint32_t symbol_stack,
+                          std::uint64_t hot_value, std::uint64_t cold_value) {
+    if (this->runs.empty() || this->runs.back().symbol_stack != symbol_stack) {
+      this->runs.push_back({symbol_stack, (std::uint32_t)this->entries.size(), 0, 0, 0});
+    }
+
+    Run &run = this->runs.back();
+    Entry *entry = nullptr;
+
+    // Entries of the last run are always at the end of this->entries.
+    for (std::uint32_t i = run.first_entry; i < run.first_entry + run.entry_count; i++) {
+      if (this->entries[i].frame_stack == frame_stack) {
+        entry = &this->entries[i];
+        break;
+      }
+    }
+
+    if (!entry) {
+      this->entries.push_back({frame_stack, 0, 0});
+      run.entry_count++;
+      entry = &this->entries.back();
+    }
+
+    run.hot_value += hot_value;
+    run.cold_value += cold_value;
+    entry->hot_value += hot_value;
+    entry->cold_value += cold_value;
+  }
+
+  /**
+     Expands the sequence and writes it in the timed.json schema.
+
+     Runs are replayed in time order: a frame is merged with the last
+     child of its parent node if both have the same name and either
+     both or none of them are leaves. Otherwise, a new child is added.
+
+     As frames are only ever merged with last children, only the
+     rightmost path of the tree is kept in memory. A node is written
+     as soon as a run diverges from the path above it, so memory use
+     is bounded by the depth of the tree rather than by its size.
+  */
+  void TimedSequence::write(JsonWriter &writer) {
+    struct Node {
+      std::uint32_t symbol;
+      std::uint64_t hot_value;
+      std::uint64_t cold_value;
+      bool has_children;
+      OffsetHistogram offsets;
+    };
+
+    // path[0] is the root, path[i] is the last child of path[i - 1]
+    std::vector<Node> path;
+
+    auto open_node = [&writer, &path](std::uint32_t symbol) {
+      if (!path.empty()) {
+        path.back().has_children = true;
+      }
+
+      writer.begin_object();
+      writer.key("children");
+      writer.begin_array();
+      path.push_back(Node{symbol, 0, 0, false, {}});
+    };
+
+    auto close_node = [&writer, &path]() {
+      Node &node = path.back();
+      write_node_end(writer, path.size() == 1 ? "all" : std::to_string(node.symbol),
+                     node.hot_value, node.cold_value,
+                     path.size() == 1 ? nullptr : &node.offsets);
+      path.pop_back();
+    };
+
+    std::vector<std::uint32_t> symbols;
+    std::vector<std::uint64_t> offsets;
+
+    open_node(0);
+
+    for (Run &run : this->runs) {
+      this->stack_table.get_symbols(run.symbol_stack, symbols);
+
+      std::size_t matched = 0;
+
+      while (matched < symbols.size() && matched + 1 < path.size()) {
+        Node &child = path[matched + 1];
+        bool last_block = matched == symbols.size() - 1;
+
+        if (child.symbol != symbols[matched] || last_block == child.has_children) {
+          break;
+        }
+
+        matched++;
+      }
+
+      if (matched < symbols.size()) {
+        while (path.size() > matched + 1) {
+          close_node();
+        }
+
+        for (std::size_t i = matched; i < symbols.size(); i++) {
+          open_node(symbols[i]);
+        }
+      }
+
+      path[0].hot_value += run.hot_value;
+      path[0].cold_value += run.cold_value;
+
+      for (std::size_t i = 1; i <= symbols.size(); i++) {
+        path[i].hot_value += run.hot_value;
+        path[i].cold_value += run.cold_value;
+      }
+
+      for (std::uint32_t i = run.first_entry; i < run.first_entry + run.entry_count; i++) {
+        Entry &entry = this->entries[i];
+        this->stack_table.get_offsets(entry.frame_stack, offsets);
+
+        for (std::size_t j = 0; j < offsets.size(); j++) {
+          path[j + 1].offsets.add(offsets[j], entry.hot_value, entry.cold_value);
+        }
+      }
+    }
+
+    while (!path.empty()) {
+      close_node();
+    }
+  }
+};
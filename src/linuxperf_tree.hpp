@@ -0,0 +1,180 @@
+// SPDX-FileCopyrightText: 2025 CERN
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef LINUXPERF_TREE_HPP_
+#define LINUXPERF_TREE_HPP_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "linuxperf_symbols.hpp"
+#include "linuxperf_output.hpp"
+
+namespace adaptyst {
+  /**
+     A class describing per-offset hot and cold values of a tree node.
+
+     Entries are kept in a flat vector sorted by offset, as most nodes
+     have only a few distinct offsets.
+  */
+  class OffsetHistogram {
+  public:
+    struct Entry {
+      std::uint64_t offset;
+      std::uint64_t hot_value;
+      std::uint64_t cold_value;
+    };
+
+  private:
+    std::vector<Entry> entries;
+
+  public:
+    void add(std::uint64_t offset, std::uint64_t hot_value,
+             std::uint64_t cold_value);
+    void write(JsonWriter &writer);
+  };
+
+  /**
+     A class describing a calling-context tree aggregating samples
+     regardless of their time order (i.e. the untimed view of
+     a thread).
+
+     Nodes are stored in a contiguous arena and linked by indices. Children are looked up through a single
+     hash map keyed by a parent index and a symbol ID.
+     The tree is serialised to the untimed.json schema only by write().
+  */
+  class CallTree {
+  private:
+    static constexpr std::uint32_t NONE = UINT32_MAX;
+
+    struct Node {
+      std::uint32_t symbol;
+      std::uint32_t first_child;
+      std::uint32_t next_sibling;
+      std::uint64_t hot_value;
+      std::uint64_t cold_value;
+      OffsetHistogram offsets;
+    };
+
+    std::vector<Node> nodes;
+    std::unordered_map<std::uint64_t, std::uint32_t> edges;
+
+    std::uint32_t get_child(std::uint32_t parent, std::uint32_t symbol);
+
+  public:
+    CallTree();
+    void add_sample(std::vector<CallchainElem> &callchain,
+                    std::uint64_t period, bool offcpu);
+    std::size_t get_node_count();
+    std::size_t copy_nodes(CallTree &target, std::size_t begin,
+                           std::size_t count);
+    void write(JsonWriter &writer);
+  };
+
+  /**
+     A class describing a table of callchains (stacks) shared by
+     all TimedSequence objects of a connection.
+
+     Every stack is identified by two IDs: a *frame stack ID* taking
+     both symbol IDs and offsets into account and a *symbol stack ID*
+     taking only symbol IDs into account. Both are nodes of prefix trees,
+     so a stack is stored only once regardless of how many times
+     it is sampled.
+  */
+  class StackTable {
+  private:
+    struct FrameKey {
+      std::uint32_t parent;
+      std::uint32_t symbol;
+      std::uint64_t offset;
+
+      bool operator==(const FrameKey &other) const = default;
+    };
+
+    struct FrameKeyHash {
+      std::size_t operator()(const FrameKey &key) const {
+        return std::hash<std::uint64_t>()(((std::uint64_t)key.parent << 32) | key.symbol) ^
+          (std::hash<std::uint64_t>()(key.offset) * 0x9e3779b97f4a7c15ULL);
+      }
+    };
+
+    struct FrameNode {
+      std::uint32_t parent;
+      std::uint32_t symbol;
+      std::uint64_t offset;
+    };
+
+    struct SymbolNode {
+      std::uint32_t parent;
+      std::uint32_t symbol;
+    };
+
+    std::vector<FrameNode> frame_nodes;
+    std::vector<SymbolNode> symbol_nodes;
+    std::unordered_map<FrameKey, std::uint32_t, FrameKeyHash> frame_edges;
+    std::unordered_map<std::uint64_t, std::uint32_t> symbol_edges;
+
+  public:
+    StackTable();
+    std::pair<std::uint32_t, std::uint32_t>
+    add(std::vector<CallchainElem> &callchain);
+    void get_symbols(std::uint32_t symbol_stack,
+                     std::vector<std::uint32_t> &symbols);
+    void get_offsets(std::uint32_t frame_stack,
+                     std::vector<std::uint64_t> &offsets);
+    void get_callchain(std::uint32_t frame_stack,
+                       std::vector<CallchainElem> &callchain);
+    std::size_t get_memory_usage();
+  };
+
+  /**
+     A class describing the time-ordered (timed) view of a thread.
+
+     Samples are stored as a sequence of runs. A run groups consecutive
+     samples with the same symbol stack, which always land in the same
+     nodes of the timed tree, and keeps per-frame-stack counters for
+     distributing the run values among offsets. The sequence is expanded
+     to the timed.json schema only by write(), which streams the tree
+     to the writer while keeping only its rightmost path in memory.
+
+     The memory used by the sequence can be bounded with compact(),
+     which trades the time resolution of older samples for space.
+  */
+  class TimedSequence {
+  private:
+    static constexpr std::uint64_t COMPACTION_BUCKETS = 256;
+
+    struct Entry {
+      std::uint32_t frame_stack;
+      std::uint64_t hot_value;
+      std::uint64_t cold_value;
+    };
+
+    struct Run {
+      std::uint32_t symbol_stack;
+      std::uint32_t first_entry;
+      std::uint32_t entry_count;
+      std::uint64_t hot_value;
+      std::uint64_t cold_value;
+    };
+
+    StackTable &stack_table;
+    std::vector<Run> runs;
+    std::vector<Entry> entries;
+
+    void add(std::uint32_t frame_stack, std::uint32_t symbol_stack,
+             std::uint64_t hot_value, std::uint64_t cold_value);
+
+  public:
+    TimedSequence(StackTable &stack_table);
+    void add_sample(std::vector<CallchainElem> &callchain,
+                    std::uint64_t period, bool offcpu);
+    void append(TimedSequence &other);
+    std::size_t get_memory_usage();
+    void compact();
+    void write(JsonWriter &writer);
+  };
+};
+
+#endif
@@ -10,9 +10,14 @@ import subprocess
 import json
 import re
 import socket
+import struct
+import fcntl
+import termios
 import importlib.util
+import time
 from cxxfilt import demangle
 from bisect import bisect_right
+from functools import lru_cache
 from pathlib import Path
 from collections import defaultdict
 
@@ -22,46 +27,165 @@ sys.path.append(os.environ['PERF_EXEC_PATH'] +
 from perf_trace_context import *
 from Core import *
 
-allowed_chars = 'abcdefghijklmnopqrstuvwxyz' + \
-    'ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'
-cur_code_sym = [0]
+# Frame types of the binary wire format (see FrameType in
+# linuxperf_protocol.hpp). Every frame is a native-endian 32-bit
+# payload length followed by the payload starting with the frame type.
+#
+# FRAME_SAMPLE payload layout (native endianness, no padding):
+# int32 pid, int32 tid, uint64 time, uint64 period,
+# uint8 event type length, event type, uint32 callchain length,
+# (uint32 symbol code, uint64 offset) * callchain length
+FRAME_MESSAGE = 0
+FRAME_SAMPLE = 1
+FRAME_STOP = 2
+NO_OFFSET = 2**64 - 1
+
+# The number of new offsets in executables/libraries after which
+# they are sent to the module for source code resolution
+# (see SOURCE_BATCH_SIZE in linuxperf.cpp)
+SOURCE_BATCH_SIZE = 4096
+
+# The number of samples after which the load of event streams is
+# checked and a thread may be moved from the most backlogged stream
+# to the least backlogged one (see rebalance())
+REBALANCE_INTERVAL = 10000
+
+# The number of bytes not yet read by the module from an event stream
+# above which the stream is considered backlogged
+BACKLOG_THRESHOLD = 32768
+
+# The number of samples whose callchains are passed at once to
+# process_batch() of a Python filter script, if it defines one
+FILTER_BATCH_SIZE = 1024
+
+# The maximum number of symbol names whose demangled forms are cached
+# (see demangle_cached())
+DEMANGLE_CACHE_SIZE = 65536
+
+sample_header_struct = struct.Struct('=iiQQB')
+callchain_formats = {}
+
+event_streams = []
+stream_loads = []
+stream_thread_counts = []
+thread_loads = defaultdict(int)
+thread_streams = {}
+move_count = 0
+sample_count = 0
+max_backlogs = []
+throttle_counts = defaultdict(int)
+symbol_dict = {}
+symbol_list = []
+sent_symbols = defaultdict(set)
+dso_dict = defaultdict(set)
+pending_sources = defaultdict(list)
+pending_source_count = 0
+overall_event_type = None
+perf_maps = {}
+filter_settings = None
+filter_decisions = {}
+pending_filter_samples = []
+wire_format = 'json'
 
 
-def next_code(cur_code):
-    res = ''.join(map(lambda x: allowed_chars[x], cur_code))
+frontend_stream = None
 
-    for i in range(len(cur_code)):
-        cur_code[i] += 1
 
-        if cur_code[i] < len(allowed_chars):
-            break
+# Returns the number of bytes written to an event stream, but
+# not yet read by the module.
+def get_backlog(stream):
+    try:
+        if isinstance(stream, socket.socket):
+            request = termios.TIOCOUTQ
         else:
-            cur_code[i] = len(allowed_chars) - 1
+            request = termios.FIONREAD
 
-            if i == len(cur_code) - 1:
-                cur_code.append(0)
+        return struct.unpack('i', fcntl.ioctl(stream.fileno(), request,
+                                              b'\0' * 4))[0]
+    except OSError:
+        return 0
 
-    return res
 
+def get_stream_load(index):
+    return (get_backlog(event_streams[index]), stream_loads[index],
+            stream_thread_counts[index])
 
-event_streams = []
-next_index = 0
-symbol_dict = defaultdict(lambda: next_code(cur_code_sym))
-dso_dict = defaultdict(set)
-overall_event_type = None
-perf_maps = {}
-filter_settings = None
 
+# Threads are assigned to the least loaded event stream on first
+# sight, where the load is the backlog of a stream, the number
+# of samples sent through it recently and the number of threads
+# assigned to it.
+def get_event_stream(pid, tid):
+    index = thread_streams.get((pid, tid))
 
-def get_next_event_stream():
-    global event_streams, next_index
-    stream = event_streams[next_index]
-    next_index = (next_index + 1) % len(event_streams)
-    return stream
+    if index is None:
+        index = min(range(len(event_streams)), key=get_stream_load)
+        thread_streams[(pid, tid)] = index
+        stream_thread_counts[index] += 1
 
+    return index
 
-event_stream_dict = defaultdict(lambda: defaultdict(get_next_event_stream))
-frontend_stream = None
+
+# A thread is moved between event streams by sending "release" through
+# the old stream and "takeover" through the new one before any of
+# its samples. The module processing the new stream waits for the old
+# stream to reach "release" and only then takes over the state of
+# the thread, so samples of a thread are always processed in order.
+#
+# Each move is numbered and both messages carry the number, as
+# a thread may be moved again before the module has completed its
+# previous move.
+def move_thread(thread, index):
+    global move_count
+
+    move_count += 1
+    data = {'pid': str(thread[0]), 'tid': str(thread[1]),
+            'move': str(move_count)}
+
+    write_event(event_streams[thread_streams[thread]], {
+        'type': 'release',
+        'data': data
+    })
+
+    write_event(event_streams[index], {
+        'type': 'takeover',
+        'data': data
+    })
+
+    stream_thread_counts[thread_streams[thread]] -= 1
+    stream_thread_counts[index] += 1
+    thread_streams[thread] = index
+
+
+# If the most backlogged event stream is above BACKLOG_THRESHOLD,
+# the thread of the stream whose recent load best evens out the loads
+# of that stream and the least backlogged one is moved to the latter.
+#
+# The highest backlogs of the event streams seen here are reported
+# to the module at the end (see write_telemetry()).
+def rebalance():
+    global stream_loads, thread_loads
+
+    loads = [get_stream_load(i) for i in range(len(event_streams))]
+
+    for i in range(len(loads)):
+        max_backlogs[i] = max(max_backlogs[i], loads[i][0])
+
+    if len(event_streams) > 1:
+        src = max(range(len(loads)), key=lambda i: loads[i])
+        dst = min(range(len(loads)), key=lambda i: loads[i])
+        gap = stream_loads[src] - stream_loads[dst]
+
+        if loads[src][0] >= BACKLOG_THRESHOLD and src != dst:
+            candidates = [(abs(gap - 2 * load), thread)
+                          for thread, load in thread_loads.items()
+                          if thread_streams[thread] == src and load < gap]
+
+            if len(candidates) > 0:
+                move_thread(min(candidates)[1], dst)
+
+    stream_loads = [0] * len(event_streams)
+    thread_loads = defaultdict(int)
 
 
 # import_from_path is from
@@ -86,71 +210,198 @@ def write(stream, msg):
         stream.flush()
 
 
-def find_in_map(map_path, map_id, ip):
-    global perf_maps
+def write_frame(stream, frame_type, payload):
+    frame = struct.pack('=IB', len(payload) + 1, frame_type) + payload
 
-    if map_id not in perf_maps:
-        if map_path.exists():
-            perf_maps[map_id] = (map_path,
-                                 map_path.open(mode='r'), [0], [])
-        else:
-            perf_maps[map_id] = (map_path, None, None, None)
-            return None
+    if isinstance(stream, socket.socket):
+        stream.sendall(frame)
+    else:
+        stream.write(frame)
+        stream.flush()
 
-    _, f, i, groups = perf_maps[map_id]
 
-    if f is None:
-        return None
+# Sends a message through a non-generic connection, respecting
+# the wire format negotiated with the module.
+def write_event(stream, msg):
+    if wire_format == 'binary':
+        write_frame(stream, FRAME_MESSAGE,
+                    json.dumps(msg).encode('utf-8'))
+    else:
+        write(stream, json.dumps(msg))
 
-    for group in groups:
-        index = bisect_right(group, ip,
-                             key=lambda x: x[0]) - 1
 
-        if index >= 0 and index < len(group) and group[index][0] <= ip and \
-           group[index][0] + group[index][1] > ip:
-            return group[index][2]
+# Symbol codes are local to this script: the module maps them to IDs
+# shared by all profilers, so every code must be defined through
+# a "symbol" message before its first use on a given stream.
+def get_symbol_code(sym_result):
+    code = symbol_dict.get(sym_result)
 
-    to_add = []
+    if code is None:
+        code = len(symbol_list)
+        symbol_dict[sym_result] = code
+        symbol_list.append(sym_result)
+
+    return code
+
+
+def write_symbols(stream, callchain):
+    sent = sent_symbols[stream]
+
+    for code, _ in callchain:
+        if code not in sent:
+            sent.add(code)
+            write_event(stream, {
+                'type': 'symbol',
+                'data': {
+                    'code': code,
+                    'name': symbol_list[code][0],
+                    'dso': symbol_list[code][1]
+                }
+            })
 
-    while True:
-        try:
-            line = next(f).strip()
-        except StopIteration:
-            break
 
-        i[0] += 1
+def write_sample(stream, event_type, pid, tid, timestamp, period,
+                 callchain):
+    write_symbols(stream, callchain)
 
-        match = re.search(
-            r'^([0-9a-fA-F]+)\s+([0-9a-fA-F]+)\s+(.+)$', line)
+    if wire_format == 'binary':
+        event_type_bytes = event_type.encode('utf-8')
+        callchain_format = callchain_formats.get(len(callchain))
 
-        if match is None:
-            print(f'Line {i[0]}, {map_path}: '
-                  'incorrect syntax, ignoring.',
-                  file=sys.stderr)
-            continue
+        if callchain_format is None:
+            callchain_format = struct.Struct('=I' + 'IQ' * len(callchain))
+            callchain_formats[len(callchain)] = callchain_format
 
-        data = (int(match.group(1), 16),
-                int(match.group(2), 16),
-                demangle(match.group(3), False))
+        callchain_flat = []
 
-        to_add.append(data)
+        for sym, off in callchain:
+            callchain_flat.append(sym)
+            callchain_flat.append(off)
 
-        if data[0] <= ip and data[0] + data[1] > ip:
-            if len(to_add) > 0:
-                to_add.sort(key=lambda x: x[0])
-                perf_maps[map_id][-1].append(to_add)
+        write_frame(stream, FRAME_SAMPLE,
+                    sample_header_struct.pack(pid, tid, timestamp, period,
+                                              len(event_type_bytes)) +
+                    event_type_bytes +
+                    callchain_format.pack(len(callchain), *callchain_flat))
+    else:
+        write(stream, json.dumps({
+            'type': 'sample',
+            'data': {
+                'event_type': event_type,
+                'pid': str(pid),
+                'tid': str(tid),
+                'time': timestamp,
+                'period': period,
+                'callchain': callchain
+            }
+        }))
+
+
+# Demangling goes through ctypes and allocates a new buffer every time,
+# while the same (often long) names are demangled over and over again.
+@lru_cache(maxsize=DEMANGLE_CACHE_SIZE)
+def demangle_cached(name):
+    return demangle(name, False)
+
+
+# A class describing a symbol map written by a JIT runtime
+# (/tmp/perf-<pid>.map). Entries are kept sorted by start address and
+# looked up by bisection. As runtimes keep appending to their maps while
+# running, an address not found in the entries read so far makes
+# the map read all complete lines appended to the file since then.
+class PerfMap:
+    def __init__(self, path):
+        self.path = path
+        self.exists = path.exists()
+        self.file = path.open(mode='rb') if self.exists else None
+        self.incomplete_line = b''
+        self.line_number = 0
+        self.starts = []
+        self.entries = []
+
+    def load(self):
+        data = self.file.read()
+
+        if not data:
+            return False
+
+        data = self.incomplete_line + data
+        complete = data.rfind(b'\n')
+
+        if complete == -1:
+            self.incomplete_line = data
+            return False
 
-            return data[2]
+        self.incomplete_line = data[complete + 1:]
+        new_entries = []
 
-    if len(to_add) > 0:
-        to_add.sort(key=lambda x: x[0])
-        perf_maps[map_id][-1].append(to_add)
+        for line in data[:complete].decode('utf-8',
+                                           errors='replace').split('\n'):
+            self.line_number += 1
+
+            match = re.search(
+                r'^([0-9a-fA-F]+)\s+([0-9a-fA-F]+)\s+(.+)$', line.strip())
+
+            if match is None:
+                print(f'Line {self.line_number}, {self.path}: '
+                      'incorrect syntax, ignoring.',
+                      file=sys.stderr)
+                continue
+
+            new_entries.append((int(match.group(1), 16),
+                                int(match.group(2), 16),
+                                demangle_cached(match.group(3))))
+
+        if len(new_entries) == 0:
+            return False
 
-    return None
+        # Entries added later take precedence over earlier ones at the
+        # same address, which stable sorting preserves.
+        new_entries.sort(key=lambda x: x[0])
+
+        if len(self.entries) > 0 and new_entries[0][0] < self.entries[-1][0]:
+            self.entries = sorted(self.entries + new_entries,
+                                  key=lambda x: x[0])
+            self.starts = [entry[0] for entry in self.entries]
+        else:
+            self.entries.extend(new_entries)
+            self.starts.extend(entry[0] for entry in new_entries)
+
+        return True
+
+    def find(self, ip):
+        if self.file is None:
+            return None
+
+        for _ in range(2):
+            index = bisect_right(self.starts, ip) - 1
+
+            if index >= 0 and \
+               ip < self.entries[index][0] + self.entries[index][1]:
+                return self.entries[index][2]
+
+            if not self.load():
+                break
+
+        return None
+
+    def close(self):
+        if self.file is not None:
+            self.file.close()
+
+
+def find_in_map(map_path, map_id, ip):
+    perf_map = perf_maps.get(map_id)
+
+    if perf_map is None:
+        perf_map = PerfMap(map_path)
+        perf_maps[map_id] = perf_map
+
+    return perf_map.find(ip)
 
 
 def trace_begin():
-    global event_streams, frontend_stream, filter_settings
+    global event_streams, frontend_stream, filter_settings, wire_format
 
     connect = os.environ['ADAPTYST_CONNECT'].split(' ')
     frontend_parts = connect[1].split('_')
@@ -175,6 +426,10 @@ def trace_begin():
             stream.flush()
             event_streams.append(stream)
 
+    stream_loads.extend([0] * len(event_streams))
+    stream_thread_counts.extend([0] * len(event_streams))
+    max_backlogs.extend([0] * len(event_streams))
+
     frontend_stream_read = os.fdopen(int(frontend_parts[0]), 'r')
     for line in frontend_stream_read:
         line = line.strip()
@@ -192,29 +447,61 @@ def trace_begin():
                     import_from_path('module',
                                      filter_settings['script'])
                 filter_settings['module'].setup()
+                filter_settings['batch'] = \
+                    hasattr(filter_settings['module'], 'process_batch')
+            else:
+                filter_settings['conditions'] = \
+                    compile_conditions(filter_settings['conditions'])
+        elif command['type'] == 'wire_format':
+            wire_format = command['data']
 
     frontend_stream_read.close()
 
 
+def add_source(dso, offset):
+    global pending_source_count
+
+    if offset not in dso_dict[dso]:
+        dso_dict[dso].add(offset)
+        pending_sources[dso].append(offset)
+        pending_source_count += 1
+
+
+# Offsets are sent while profiling is still running, so that
+# the module can resolve them to source code locations in the background.
+def write_sources():
+    global pending_sources, pending_source_count
+
+    if pending_source_count == 0:
+        return
+
+    write(frontend_stream, json.dumps({
+        'type': 'sources',
+        'data': pending_sources
+    }))
+
+    pending_sources = defaultdict(list)
+    pending_source_count = 0
+
+
 # Callchain symbol names are attempted to be obtained here. In case of
 # failure, an instruction address is put instead, along with
 # the name of an executable/library if available.
 #
 # If obtained, symbol names are compressed to save memory.
-# The dictionary mapping compressed names to full ones
-# is saved at the end of profiling (see reverse_callchain_dict in
-# trace_end()).
+# The mapping between compressed names and full ones is sent
+# to the module along with samples (see write_symbols()).
 def process_callchain_elem(elem):
     sym_result = [f'[{elem["ip"]:#x}]', '']
     sym_result_set = False
-    off_result = hex(elem['ip'])
+    off_result = elem['ip']
 
     if 'dso' in elem:
         p = Path(elem['dso'])
         perf_map_match = re.search(r'^perf\-(\d+)\.map$', p.name)
         if perf_map_match is not None:
             if 'sym' in elem and 'name' in elem['sym']:
-                sym_result[0] = demangle(elem['sym']['name'], False)
+                sym_result[0] = demangle_cached(elem['sym']['name'])
                 sym_result_set = True
             else:
                 result = find_in_map(p, perf_map_match.group(1), elem['ip'])
@@ -224,9 +511,9 @@ def process_callchain_elem(elem):
                     sym_result[0] = result
                     sym_result_set = True
         else:
-            dso_dict[elem['dso']].add(hex(elem['dso_off']))
+            add_source(elem['dso'], elem['dso_off'])
             sym_result[0] = f'[{elem["dso"]}]'
-            off_result = hex(elem['dso_off'])
+            off_result = elem['dso_off']
 
         sym_result[1] = elem['dso']
 
@@ -237,8 +524,141 @@ def process_callchain_elem(elem):
     return tuple(sym_result), off_result
 
 
+# Offsets are integers internally, but Python filter scripts have always
+# received them as hexadecimal strings ('' if there is no offset).
+def to_filter_callchain(callchain_tmp):
+    return tuple((s, '' if o == NO_OFFSET else hex(o))
+                 for s, o in callchain_tmp)
+
+
+# Parses the conditions of an allow/deny filter and compiles their
+# regular expressions, so that this is done only once per run.
+def compile_conditions(conditions):
+    compiled = []
+
+    for group in conditions:
+        compiled_group = []
+
+        for cond in group:
+            match = re.search(r'^(SYM|EXEC|ANY) (.+)$', cond)
+            compiled_group.append((match.group(1),
+                                   re.compile(match.group(2))))
+
+        compiled.append(compiled_group)
+
+    return compiled
+
+
+def satisfy_conditions(sym_result, conditions):
+    for group in conditions:
+        matched = True
+        for cond_type, regex in group:
+            if cond_type == 'SYM':
+                if regex.search(sym_result[0]) is None:
+                    matched = False
+                    break
+            elif cond_type == 'EXEC':
+                if regex.search(sym_result[1]) is None:
+                    matched = False
+                    break
+            elif cond_type == 'ANY':
+                if regex.search(sym_result[0]) is None and \
+                   regex.search(sym_result[1]) is None:
+                    matched = False
+                    break
+
+        if matched:
+            return True
+
+    return False
+
+
+# Whether a stack element is accepted by an allow/deny filter depends
+# only on its symbol name and executable/library, so the decision
+# is made once per symbol and cached.
+def is_accepted(sym_result):
+    accepted = filter_decisions.get(sym_result)
+
+    if accepted is None:
+        accepted = satisfy_conditions(sym_result,
+                                      filter_settings['conditions'])
+
+        if filter_settings['type'] == 'deny':
+            accepted = not accepted
+
+        filter_decisions[sym_result] = accepted
+
+    return accepted
+
+
+# Gets the decisions of a Python filter script for a list of
+# callchains. If the script defines process_batch(), it receives
+# all callchains at once and must return a list of the return values
+# process() would give for each of them. Otherwise, process()
+# is called for every callchain.
+def run_python_filter(callchains_tmp):
+    module = filter_settings['module']
+
+    if filter_settings['batch']:
+        function = 'process_batch()'
+        results = module.process_batch(
+            [to_filter_callchain(c) for c in callchains_tmp])
+
+        if results is None or not isinstance(results, list) or \
+           len(results) != len(callchains_tmp):
+            raise RuntimeError(f'Invalid value of {function} from the ' +
+                               'provided Python script: it is not ' +
+                               f'a list of size {len(callchains_tmp)}')
+    else:
+        function = 'process()'
+        results = [module.process(to_filter_callchain(c))
+                   for c in callchains_tmp]
+
+    for accepted, callchain_tmp in zip(results, callchains_tmp):
+        if accepted is None or not isinstance(accepted, list) or \
+           len(accepted) != len(callchain_tmp):
+            raise RuntimeError(f'Invalid value of {function} from the ' +
+                               'provided Python script: it is not ' +
+                               f'a list of size {len(callchain_tmp)} ' +
+                               'for a callchain')
+
+        for i, elem in enumerate(accepted):
+            if not isinstance(elem, bool):
+                raise RuntimeError(f'Invalid value of {function} from the ' +
+                                   'provided Python script: a non-boolean ' +
+                                   f'element at index {i}')
+
+    return results
+
+
+# Filters a callchain according to filter_settings, keeping
+# the order of its elements. For Python filter scripts, the decisions
+# can be given in accepted if they have already been obtained.
+def filter_callchain(callchain_tmp, accepted=None):
+    callchain = []
+
+    if filter_settings['type'] == 'python' and accepted is None:
+        accepted = run_python_filter([callchain_tmp])[0]
+
+    last_cut = False
+    for i, (sym_result, off_result) in enumerate(callchain_tmp):
+        if accepted is None:
+            satisfied = is_accepted(sym_result)
+        else:
+            satisfied = accepted[i]
+
+        if satisfied:
+            callchain.append((get_symbol_code(sym_result), off_result))
+            last_cut = False
+        elif filter_settings['mark'] and not last_cut:
+            callchain.append((get_symbol_code(('(cut)', '')), NO_OFFSET))
+            last_cut = True
+
+    return callchain
+
+
 def process_event(param_dict):
-    global event_stream_dict, overall_event_type, perf_map_paths
+    global overall_event_type
 
     event_type = param_dict['ev_name']
     comm = param_dict['comm']
@@ -250,6 +670,11 @@ def process_event(param_dict):
 
     parsed_event_type = re.search(r'^([^/]+)', event_type).group(1)
 
+    # Events read in a group with on-CPU samples have the group
+    # modifier appended to their names.
+    if parsed_event_type.endswith(':S'):
+        parsed_event_type = parsed_event_type[:-2]
+
     if overall_event_type is None:
         if parsed_event_type in ['task-clock', 'offcpu-time']:
             overall_event_type = 'walltime'
@@ -259,117 +684,128 @@ def process_event(param_dict):
     callchain_tmp = tuple(map(process_callchain_elem, raw_callchain))
 
     if filter_settings is None:
-        callchain = [(symbol_dict[s], o) for s, o
+        callchain = [(get_symbol_code(s), o) for s, o
                      in reversed(callchain_tmp)]
+    elif filter_settings.get('batch', False):
+        pending_filter_samples.append((parsed_event_type, pid, tid,
+                                       timestamp, period, callchain_tmp))
+
+        if len(pending_filter_samples) >= FILTER_BATCH_SIZE:
+            flush_filter_batch()
+
+        return
     else:
-        callchain = []
-
-        def satisfy_conditions(sym_result, conditions):
-            for group in conditions:
-                matched = True
-                for cond in group:
-                    match = re.search(r'^(SYM|EXEC|ANY) (.+)$',
-                                      cond)
-
-                    cond_type = match.group(1)
-                    regex = match.group(2)
-
-                    if cond_type == 'SYM':
-                        if re.search(regex, sym_result[0]) is None:
-                            matched = False
-                            break
-                    elif cond_type == 'EXEC':
-                        if re.search(regex, sym_result[1]) is None:
-                            matched = False
-                            break
-                    elif cond_type == 'ANY':
-                        if re.search(regex, sym_result[0]) is None and \
-                           re.search(regex, sym_result[1]) is None:
-                            matched = False
-                            break
-
-                if matched:
-                    return True
+        callchain = filter_callchain(callchain_tmp)[::-1]
 
-            return False
+    send_sample(parsed_event_type, pid, tid, timestamp, period, callchain)
 
-        if filter_settings['type'] == 'python':
-            accepted = filter_settings['module'].process(callchain_tmp)
 
-            if accepted is None or not isinstance(accepted, list) or \
-               len(accepted) != len(callchain_tmp):
-                raise RuntimeError('Invalid value of process() from the ' +
-                                   'provided Python script: it is not ' +
-                                   f'a list of size {len(callchain_tmp)}')
-        else:
-            accepted = None
+# Samples waiting for a Python filter script are filtered in one
+# process_batch() call, with every distinct callchain passed only once.
+def flush_filter_batch():
+    global pending_filter_samples
 
-        last_cut = False
-        for i, (sym_result, off_result) in enumerate(callchain_tmp):
-            if accepted is None:
-                satisfied = satisfy_conditions(sym_result,
-                                               filter_settings['conditions'])
-            else:
-                if not isinstance(accepted[i], bool):
-                    raise RuntimeError('Invalid value of process() from the ' +
-                                       'provided Python script: a non-boolean ' +
-                                       f'element at index {i}')
+    if len(pending_filter_samples) == 0:
+        return
 
-                satisfied = accepted[i]
+    unique_callchains = {}
 
-            if (filter_settings['type'] in ['python', 'allow'] and satisfied) or \
-               (filter_settings['type'] == 'deny' and not satisfied):
-                callchain.append((symbol_dict[sym_result], off_result))
-                last_cut = False
-            elif filter_settings['mark'] and not last_cut:
-                callchain.append((symbol_dict[('(cut)', '')], ''))
-                last_cut = True
+    for sample in pending_filter_samples:
+        unique_callchains.setdefault(sample[5], len(unique_callchains))
 
-        callchain = callchain[::-1]
+    results = run_python_filter(list(unique_callchains))
+
+    for event_type, pid, tid, timestamp, period, callchain_tmp in \
+            pending_filter_samples:
+        callchain = filter_callchain(
+            callchain_tmp, results[unique_callchains[callchain_tmp]])[::-1]
+        send_sample(event_type, pid, tid, timestamp, period, callchain)
+
+    pending_filter_samples = []
+
+
+def send_sample(parsed_event_type, pid, tid, timestamp, period, callchain):
+    global sample_count
 
     if len(callchain) == 0:
-        callchain.append((symbol_dict[('(just thread/process)', '')], ''))
+        callchain.append((get_symbol_code(('(just thread/process)', '')),
+                          NO_OFFSET))
+
+    index = get_event_stream(pid, tid)
+    write_sample(event_streams[index], parsed_event_type,
+                 pid, tid, timestamp, period, callchain)
 
-    write(event_stream_dict[pid][tid], json.dumps({
-        'type': 'sample',
+    stream_loads[index] += 1
+    thread_loads[(pid, tid)] += 1
+    sample_count += 1
+
+    if sample_count % REBALANCE_INTERVAL == 0:
+        rebalance()
+
+    if pending_source_count >= SOURCE_BATCH_SIZE:
+        write_sources()
+
+
+# Reports the overhead of this script to the module, so that it can
+# be told apart from the overhead of the module itself.
+def write_telemetry():
+    write(frontend_stream, json.dumps({
+        'type': 'telemetry',
         'data': {
-            'event_type': parsed_event_type,
-            'pid': str(pid),
-            'tid': str(tid),
-            'time': timestamp,
-            'period': period,
-            'callchain': callchain
+            'samples': sample_count,
+            'cpu_time': time.process_time_ns(),
+            'max_backlogs': max_backlogs
         }
     }))
 
 
+# Called by perf-script whenever the kernel throttles sampling of
+# a thread because of too high a sample rate (see perf-script-python).
+def throttle(timestamp, event_id, stream_id, cpu, pid, tid):
+    throttle_counts[(pid, tid)] += 1
+
+
+# Reports throttling per thread to the module. Lost samples are not
+# passed to perf-script handlers, so only the native decoder of
+# the module can count them.
+def write_losses():
+    write(frontend_stream, json.dumps({
+        'type': 'losses',
+        'data': [{
+            'event_type': '',
+            'pid': pid,
+            'tid': tid,
+            'lost': 0,
+            'throttles': count
+        } for (pid, tid), count in throttle_counts.items()]
+    }))
+
+
 def trace_end():
-    global event_streams, callchain_dict, overall_event_type, perf_map_paths, \
+    global event_streams, callchain_dict, overall_event_type, \
         perf_maps
 
-    for stream in event_streams:
-        write(stream, '<STOP>')
-        stream.close()
+    flush_filter_batch()
 
-    reverse_symbol_dict = {v: k for k, v in symbol_dict.items()}
+    for stream in event_streams:
+        if wire_format == 'binary':
+            write_frame(stream, FRAME_STOP, b'')
+        else:
+            write(stream, '<STOP>')
 
-    write(frontend_stream, json.dumps({
-        'type': 'callchains',
-        'data': reverse_symbol_dict
-    }))
+        stream.close()
 
-    write(frontend_stream, json.dumps({
-        'type': 'sources',
-        'data': {k: list(v) for k, v in dso_dict.items()}
-    }))
+    write_sources()
+    write_telemetry()
+    write_losses()
 
     missing_maps = []
 
-    for map_path, f, _, _ in perf_maps.values():
-        if f is None:
-            missing_maps.append(str(map_path))
+    for perf_map in perf_maps.values():
+        if perf_map.exists:
+            perf_map.close()
         else:
-            f.close()
+            missing_maps.append(str(perf_map.path))
 
     write(frontend_stream, json.dumps({
         'type': 'missing_symbol_maps',
@@ -380,8 +816,11 @@ def trace_end():
     frontend_stream.close()
 
 
+# Thread tree events always go through the first event stream, as
+# the module builds the tree (seeded with the threads attached to,
+# if any) from a single connection.
 def syscall_callback(stack, ret_value):
-    global perf_map_paths, dso_dict, event_stream_dict
+    global dso_dict
 
     if int(ret_value) == 0:
         return
@@ -389,83 +828,23 @@ def syscall_callback(stack, ret_value):
     callchain_tmp = tuple(map(process_callchain_elem, stack))
 
     if filter_settings is None:
-        callchain = [(symbol_dict[s], o) for s, o in callchain_tmp]
+        callchain = [(get_symbol_code(s), o) for s, o in callchain_tmp]
     else:
-        callchain = []
-
-        def satisfy_conditions(sym_result, conditions):
-            for group in conditions:
-                matched = True
-                for cond in group:
-                    match = re.search(r'^(SYM|EXEC|ANY) (.+)$',
-                                      cond)
-
-                    cond_type = match.group(1)
-                    regex = match.group(2)
-
-                    if cond_type == 'SYM':
-                        if re.search(regex, sym_result[0]) is None:
-                            matched = False
-                            break
-                    elif cond_type == 'EXEC':
-                        if re.search(regex, sym_result[1]) is None:
-                            matched = False
-                            break
-                    elif cond_type == 'ANY':
-                        if re.search(regex, sym_result[0]) is None and \
-                           re.search(regex, sym_result[1]) is None:
-                            matched = False
-                            break
-
-                if matched:
-                    return True
-
-            return False
+        callchain = filter_callchain(callchain_tmp)
 
-        if filter_settings['type'] == 'python':
-            accepted = filter_settings['module'].process(callchain_tmp)
-
-            if accepted is None or not isinstance(accepted, list) or \
-               len(accepted) != len(callchain_tmp):
-                raise RuntimeError('Invalid value of process() from the ' +
-                                   'provided Python script: it is not ' +
-                                   f'a list of size {len(callchain_tmp)}')
-        else:
-            accepted = None
-
-        last_cut = False
-        for i, (sym_result, off_result) in enumerate(callchain_tmp):
-            if accepted is None:
-                satisfied = satisfy_conditions(sym_result,
-                                               filter_settings['conditions'])
-            else:
-                if not isinstance(accepted[i], bool):
-                    raise RuntimeError('Invalid value of process() from the ' +
-                                       'provided Python script: a non-boolean ' +
-                                       f'element at index {i}')
-
-                satisfied = accepted[i]
-
-            if (filter_settings['type'] in ['python', 'allow'] and satisfied) or \
-               (filter_settings['type'] == 'deny' and not satisfied):
-                callchain.append((symbol_dict[sym_result], off_result))
-                last_cut = False
-            elif filter_settings['mark'] and not last_cut:
-                callchain.append((symbol_dict[('(cut)', '')], ''))
-                last_cut = True
-
-    write(event_stream_dict[0][0], json.dumps({
+    write_symbols(event_streams[0], callchain)
+    write_event(event_streams[0], {
         'type': 'syscall',
         'data': {
             'ret_value': str(ret_value),
             'callchain': callchain
         }
-    }))
+    })
 
 
 def syscall_tree_callback(syscall_type, comm_name, pid, tid, time,
                           ret_value):
-    write(event_stream_dict[0][0], json.dumps({
+    write_event(event_streams[0], {
         'type': 'syscall_meta',
         'data': {
             'subtype': syscall_type,
@@ -475,7 +854,7 @@ def syscall_tree_callback(syscall_type, comm_name, pid, tid, time,
             'time': time,
             'ret_value': str(ret_value)
         }
-    }))
+    })
 
 
 def sched__sched_process_fork(event_name, context, common_cpu,